@@ -16,112 +16,112 @@
 
 #include "octopass.h"
 
-static pthread_mutex_t OCTOPASS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-static json_t *ent_json_root          = NULL;
-static int ent_json_idx               = 0;
+// Enumeration state is kept per thread, so concurrent enumerations never share a cursor.
+static __thread struct snapshot *ent_snapshot = NULL;
+static __thread json_t *ent_json_root         = NULL;
+static __thread int ent_json_idx              = 0;
 
-static int pack_group_struct(json_t *root, struct group *result, char *buffer, size_t buflen, struct config *con)
-{
-  char *next_buf = buffer;
-  size_t bufleft = buflen;
+// Size the last group that did not fit needs, so callers can grow their buffer in one step.
+static __thread size_t grent_buflen_hint = 0;
 
-  if (!json_is_array(root)) {
+// Packs everything into the caller's buffer, nothing is allocated.
+// The NULL terminated member array comes first, followed by the strings.
+static int pack_group_struct(struct team *team, struct group *result, char *buffer, size_t buflen)
+{
+  if (!json_is_array(team->members)) {
     return -1;
   }
 
-  memset(buffer, '\0', buflen);
+  size_t count    = json_array_size(team->members);
+  size_t align    = (sizeof(char *) - ((uintptr_t)buffer % sizeof(char *))) % sizeof(char *);
+  size_t name_len = strlen(team->name) + 1;
+  size_t required = (count + 1) * sizeof(char *) + name_len + team->logins_len;
 
-  // Carve off some space for array of members.
-  result->gr_mem    = (char **)next_buf;
-  result->gr_name   = strdup(con->group_name);
-  result->gr_passwd = "x";
-  result->gr_gid    = con->gid;
+  if (buflen < align + required) {
+    grent_buflen_hint = required + sizeof(char *) - 1;
+    return -2;
+  }
 
-  int i;
-  for (i = 0; i < json_array_size(root); i++) {
-    json_t *j_member = json_object_get(json_array_get(root, i), "login");
+  result->gr_mem = (char **)(buffer + align);
+  char *next_buf = buffer + align + (count + 1) * sizeof(char *);
+
+  result->gr_name = memcpy(next_buf, team->name, name_len);
+  next_buf += name_len;
+
+  size_t i;
+  for (i = 0; i < count; i++) {
+    json_t *j_member = json_object_get(json_array_get(team->members, i), "login");
     if (!json_is_string(j_member)) {
       return -1;
     }
     const char *login = json_string_value(j_member);
-    if (bufleft <= strlen(login)) {
-      return -2;
-    }
-    result->gr_mem[i] = strdup(login);
-
-    next_buf += strlen(result->gr_mem[i]) + 1;
-    bufleft -= strlen(result->gr_mem[i]) + 1;
+    size_t len        = strlen(login) + 1;
+    result->gr_mem[i] = memcpy(next_buf, login, len);
+    next_buf += len;
   }
+  result->gr_mem[count] = NULL;
+
+  result->gr_passwd = "x";
+  result->gr_gid    = team->gid;
 
   return 0;
 }
 
-enum nss_status _nss_octopass_setgrent_locked(int stayopen)
+// Groups the config does not define are rejected before any I/O.
+static int config_has_group_gid(struct config *con, gid_t gid)
 {
-  json_t *root;
-  json_error_t error;
-
-  struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
-  if (con.syslog) {
-    syslog(LOG_INFO, "%s[L%d] -- stayopen: %d", __func__, __LINE__, stayopen);
+  if (gid == con->gid) {
+    return 1;
   }
-  int status = octopass_members(&con, &res);
 
-  if (status != 0) {
-    free(res.data);
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+  int i;
+  for (i = 0; i < con->teams_count; i++) {
+    if (gid == con->teams_gid[i]) {
+      return 1;
     }
-    return NSS_STATUS_UNAVAIL;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
+  return 0;
+}
 
-  if (!root) {
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
-    }
-    return NSS_STATUS_UNAVAIL;
+static int config_has_group_name(struct config *con, const char *name)
+{
+  if (strcmp(name, con->group_name) == 0) {
+    return 1;
   }
 
-  if (!json_is_array(root)) {
-    json_decref(root);
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+  int i;
+  for (i = 0; i < con->teams_count; i++) {
+    if (strcmp(name, con->teams[i]) == 0) {
+      return 1;
     }
-    return NSS_STATUS_UNAVAIL;
   }
 
-  ent_json_root = root;
-  ent_json_idx  = 0;
-
-  return NSS_STATUS_SUCCESS;
+  return 0;
 }
 
 // Called to open the group file
 enum nss_status _nss_octopass_setgrent(int stayopen)
 {
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_setgrent_locked(stayopen);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
+  struct config con;
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    return NSS_STATUS_UNAVAIL;
+  }
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- stayopen: %d", __func__, __LINE__, stayopen);
+  }
 
-enum nss_status _nss_octopass_endgrent_locked(void)
-{
-  if (ent_json_root) {
-    while (ent_json_root->refcount > 0) {
-      json_decref(ent_json_root);
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
+    if (con.syslog) {
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
     }
+    return NSS_STATUS_UNAVAIL;
   }
 
-  ent_json_root = NULL;
+  octopass_snapshot_unref(ent_snapshot);
+  ent_snapshot  = snap;
+  ent_json_root = snap->members;
   ent_json_idx  = 0;
 
   return NSS_STATUS_SUCCESS;
@@ -130,21 +130,22 @@ enum nss_status _nss_octopass_endgrent_locked(void)
 // Called to close the group file
 enum nss_status _nss_octopass_endgrent(void)
 {
-  enum nss_status status;
+  octopass_snapshot_unref(ent_snapshot);
 
-  OCTOPASS_LOCK();
-  status = _nss_octopass_endgrent_locked();
-  OCTOPASS_UNLOCK();
+  ent_snapshot  = NULL;
+  ent_json_root = NULL;
+  ent_json_idx  = 0;
 
-  return status;
+  return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_octopass_getgrent_r_locked(struct group *result, char *buffer, size_t buflen, int *errnop)
+// Called to look up next entry in group file
+enum nss_status _nss_octopass_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop)
 {
   enum nss_status ret = NSS_STATUS_SUCCESS;
 
   if (ent_json_root == NULL) {
-    ret = _nss_octopass_setgrent_locked(0);
+    ret = _nss_octopass_setgrent(0);
   }
 
   if (ret != NSS_STATUS_SUCCESS) {
@@ -152,17 +153,20 @@ enum nss_status _nss_octopass_getgrent_r_locked(struct group *result, char *buff
   }
 
   // Return notfound when there's nothing else to read.
-  if (ent_json_idx > 0) {
+  if (ent_json_idx >= ent_snapshot->teams_count) {
     *errnop = ENOENT;
     return NSS_STATUS_NOTFOUND;
   }
 
   struct config con;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d]", __func__, __LINE__);
   }
-  int pack_result = pack_group_struct(ent_json_root, result, buffer, buflen, &con);
+  int pack_result = pack_group_struct(&ent_snapshot->teams[ent_json_idx], result, buffer, buflen);
 
   if (pack_result == -1) {
     *errnop = ENOENT;
@@ -188,32 +192,19 @@ enum nss_status _nss_octopass_getgrent_r_locked(struct group *result, char *buff
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to look up next entry in group file
-enum nss_status _nss_octopass_getgrent_r(struct group *result, char *buffer, size_t buflen, int *errnop)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_getgrent_r_locked(result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
-
-enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result, char *buffer, size_t buflen,
-                                                int *errnop)
+// Find a group by gid
+enum nss_status _nss_octopass_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d] -- gid: %d", __func__, __LINE__, gid);
   }
 
-  if (gid != con.gid) {
+  if (!config_has_group_gid(&con, gid)) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -221,10 +212,8 @@ enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result,
     return NSS_STATUS_NOTFOUND;
   }
 
-  int status = octopass_members(&con, &res);
-
-  if (status != 0) {
-    free(res.data);
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
@@ -232,11 +221,10 @@ enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result,
     return NSS_STATUS_UNAVAIL;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
+  struct team *team = octopass_snapshot_team_by_gid(snap, gid);
 
-  if (json_array_size(root) == 0) {
-    json_decref(root);
+  if (team == NULL) {
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -244,10 +232,10 @@ enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result,
     return NSS_STATUS_NOTFOUND;
   }
 
-  int pack_result = pack_group_struct(root, result, buffer, buflen, &con);
+  int pack_result = pack_group_struct(team, result, buffer, buflen);
 
   if (pack_result == -1) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -256,7 +244,7 @@ enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result,
   }
 
   if (pack_result == -2) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ERANGE;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "TRYAGAIN");
@@ -268,36 +256,24 @@ enum nss_status _nss_octopass_getgrgid_r_locked(gid_t gid, struct group *result,
     syslog(LOG_INFO, "%s[L%d] -- status: %s, gr_name: %s", __func__, __LINE__, "SUCCESS", result->gr_name);
   }
 
-  json_decref(root);
+  octopass_snapshot_unref(snap);
   return NSS_STATUS_SUCCESS;
 }
 
-// Find a group by gid
-enum nss_status _nss_octopass_getgrgid_r(gid_t gid, struct group *result, char *buffer, size_t buflen, int *errnop)
-{
-  enum nss_status ret;
-
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_getgrgid_r_locked(gid, result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return ret;
-}
-
-enum nss_status _nss_octopass_getgrnam_r_locked(const char *name, struct group *result, char *buffer, size_t buflen,
-                                                int *errnop)
+// Find a group by name
+enum nss_status _nss_octopass_getgrnam_r(const char *name, struct group *result, char *buffer, size_t buflen,
+                                         int *errnop)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d] -- name: %s", __func__, __LINE__, name);
   }
 
-  if (strcmp(name, con.group_name) != 0) {
+  if (!config_has_group_name(&con, name)) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -305,10 +281,8 @@ enum nss_status _nss_octopass_getgrnam_r_locked(const char *name, struct group *
     return NSS_STATUS_NOTFOUND;
   }
 
-  int status = octopass_members(&con, &res);
-
-  if (status != 0) {
-    free(res.data);
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
@@ -316,21 +290,21 @@ enum nss_status _nss_octopass_getgrnam_r_locked(const char *name, struct group *
     return NSS_STATUS_UNAVAIL;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-  if (!root) {
-    json_decref(root);
+  struct team *team = octopass_snapshot_team_by_name(snap, name);
+
+  if (team == NULL) {
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
     }
-    return NSS_STATUS_UNAVAIL;
+    return NSS_STATUS_NOTFOUND;
   }
 
-  int pack_result = pack_group_struct(root, result, buffer, buflen, &con);
+  int pack_result = pack_group_struct(team, result, buffer, buflen);
 
   if (pack_result == -1) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -339,7 +313,7 @@ enum nss_status _nss_octopass_getgrnam_r_locked(const char *name, struct group *
   }
 
   if (pack_result == -2) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ERANGE;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "TRYAGAIN");
@@ -351,19 +325,75 @@ enum nss_status _nss_octopass_getgrnam_r_locked(const char *name, struct group *
     syslog(LOG_INFO, "%s[L%d] -- status: %s, gr_name: %s", __func__, __LINE__, "SUCCESS", result->gr_name);
   }
 
-  json_decref(root);
+  octopass_snapshot_unref(snap);
   return NSS_STATUS_SUCCESS;
 }
 
-// Find a group by name
-enum nss_status _nss_octopass_getgrnam_r(const char *name, struct group *result, char *buffer, size_t buflen,
-                                         int *errnop)
+// Find the groups a user belongs to, besides the given primary group
+enum nss_status _nss_octopass_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size,
+                                             gid_t **groupsp, long int limit, int *errnop)
 {
-  enum nss_status ret;
+  struct config con;
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- user: %s", __func__, __LINE__, user);
+  }
+
+  // Logins of every session come here, most of them system accounts.
+  if (octopass_presence_lookup(&con, user) == 0) {
+    *errnop = ENOENT;
+    if (con.syslog) {
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
+    }
+    return NSS_STATUS_NOTFOUND;
+  }
+
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
+    *errnop = ENOENT;
+    if (con.syslog) {
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+    }
+    return NSS_STATUS_UNAVAIL;
+  }
 
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_getgrnam_r_locked(name, result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
+  int i;
+  for (i = 0; i < snap->teams_count; i++) {
+    struct team *team = &snap->teams[i];
+    if (team->gid == group || json_object_get(team->logins, user) == NULL) {
+      continue;
+    }
 
-  return ret;
+    if (*start == *size) {
+      if (limit > 0 && *size >= limit) {
+        break;
+      }
+      long int newsize = *size > 0 ? *size * 2 : 8;
+      if (limit > 0 && newsize > limit) {
+        newsize = limit;
+      }
+      gid_t *groups = realloc(*groupsp, newsize * sizeof(gid_t));
+      if (groups == NULL) {
+        octopass_snapshot_unref(snap);
+        *errnop = ENOMEM;
+        if (con.syslog) {
+          syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "TRYAGAIN");
+        }
+        return NSS_STATUS_TRYAGAIN;
+      }
+      *groupsp = groups;
+      *size    = newsize;
+    }
+    (*groupsp)[(*start)++] = team->gid;
+  }
+
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- status: %s, groups: %ld", __func__, __LINE__, "SUCCESS", *start);
+  }
+
+  octopass_snapshot_unref(snap);
+  return NSS_STATUS_SUCCESS;
 }
@@ -19,11 +19,11 @@
 void show_grent(struct group *grent)
 {
   printf("%s:%s:%d", grent->gr_name, grent->gr_passwd, grent->gr_gid);
-  const int count = json_array_size(ent_json_root);
-  int i;
+  int count = 0;
 
-  for (i = 0; i < count; i++) {
-    printf(":%s", grent->gr_mem[i]);
+  while (grent->gr_mem[count] != NULL) {
+    printf(":%s", grent->gr_mem[count]);
+    count++;
   }
 
   if (count == 0) {
@@ -33,48 +33,91 @@ void show_grent(struct group *grent)
   }
 }
 
+// Grow geometrically, or straight to the size the module asked for when that is larger.
+static char *grow_buffer(char *buf, size_t *buflen)
+{
+  size_t next = *buflen * 2;
+  if (grent_buflen_hint > next) {
+    next = grent_buflen_hint;
+  }
+
+  char *grown = realloc(buf, next);
+  if (grown == NULL) {
+    fprintf(stderr, "Not enough memory for group buffer: %lu bytes\n", (unsigned long)next);
+    free(buf);
+    return NULL;
+  }
+  *buflen = next;
+
+  return grown;
+}
+
 void call_getgrnam_r(const char *name)
 {
   enum nss_status status;
   struct group grent;
-  int err    = 0;
-  int buflen = 2048;
-  char buf[buflen];
-  status = _nss_octopass_getgrnam_r(name, &grent, buf, buflen, &err);
-  if (status == NSS_STATUS_SUCCESS) {
+  int err       = 0;
+  size_t buflen = 2048;
+  char *buf     = malloc(buflen);
+
+  while (buf != NULL) {
+    status = _nss_octopass_getgrnam_r(name, &grent, buf, buflen, &err);
+    if (status != NSS_STATUS_TRYAGAIN || err != ERANGE) {
+      break;
+    }
+    buf = grow_buffer(buf, &buflen);
+  }
+
+  if (buf != NULL && status == NSS_STATUS_SUCCESS) {
     show_grent(&grent);
   }
+  free(buf);
 }
 
 void call_getgrgid_r(gid_t gid)
 {
   enum nss_status status;
   struct group grent;
-  int err    = 0;
-  int buflen = 2048;
-  char buf[buflen];
-  status = _nss_octopass_getgrgid_r(gid, &grent, buf, buflen, &err);
-  if (status == NSS_STATUS_SUCCESS) {
+  int err       = 0;
+  size_t buflen = 2048;
+  char *buf     = malloc(buflen);
+
+  while (buf != NULL) {
+    status = _nss_octopass_getgrgid_r(gid, &grent, buf, buflen, &err);
+    if (status != NSS_STATUS_TRYAGAIN || err != ERANGE) {
+      break;
+    }
+    buf = grow_buffer(buf, &buflen);
+  }
+
+  if (buf != NULL && status == NSS_STATUS_SUCCESS) {
     show_grent(&grent);
   }
+  free(buf);
 }
 
 void call_grlist(void)
 {
   enum nss_status status;
   struct group grent;
-  int err    = 0;
-  int buflen = 2048;
-  char buf[buflen];
+  int err       = 0;
+  size_t buflen = 2048;
+  char *buf     = malloc(buflen);
 
   status = _nss_octopass_setgrent(0);
 
-  while (status == NSS_STATUS_SUCCESS) {
+  while (buf != NULL && status == NSS_STATUS_SUCCESS) {
     status = _nss_octopass_getgrent_r(&grent, buf, buflen, &err);
+    if (status == NSS_STATUS_TRYAGAIN && err == ERANGE) {
+      buf    = grow_buffer(buf, &buflen);
+      status = NSS_STATUS_SUCCESS;
+      continue;
+    }
     if (status == NSS_STATUS_SUCCESS) {
       show_grent(&grent);
     }
   }
 
+  free(buf);
   status = _nss_octopass_endgrent();
 }
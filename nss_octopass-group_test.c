@@ -20,6 +20,37 @@
 
 extern void setup(void);
 
+Test(nss_octopass, pack_group_struct)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  json_t *members       = json_pack("[{s:s}, {s:s}]", "login", "linyows", "login", "ken");
+  struct snapshot *snap = octopass_snapshot_new(&con, members);
+  struct group grent;
+
+  struct team *team = &snap->teams[0];
+
+  cr_assert_eq(team->logins_len, 8 + 4);
+
+  char *buf[16];
+  cr_assert_eq(pack_group_struct(team, &grent, (char *)buf, sizeof(buf)), 0);
+  cr_assert_str_eq(grent.gr_name, "yourteam");
+  cr_assert_eq(grent.gr_gid, 2000);
+  cr_assert_str_eq(grent.gr_mem[0], "linyows");
+  cr_assert_str_eq(grent.gr_mem[1], "ken");
+  cr_assert_null(grent.gr_mem[2]);
+
+  // 3 pointers + "yourteam\0" + "linyows\0" + "ken\0"
+  size_t required = 3 * sizeof(char *) + 9 + 8 + 4;
+  cr_assert_eq(pack_group_struct(team, &grent, (char *)buf, required), 0);
+  cr_assert_eq(pack_group_struct(team, &grent, (char *)buf, required - 1), -2);
+  cr_assert_geq(grent_buflen_hint, required);
+
+  octopass_snapshot_unref(snap);
+}
+
 Test(nss_octopass, getgrnam_r, .init = setup)
 {
   enum nss_status status;
@@ -54,6 +85,77 @@ Test(nss_octopass, getgrnam_r__when_team_member_not_found, .init = setup)
   cr_assert_eq(status, NSS_STATUS_NOTFOUND);
 }
 
+Test(nss_octopass, getgrgid_r__when_team_is_empty, .init = setup)
+{
+  enum nss_status status;
+  struct group grent;
+  int err    = 0;
+  int buflen = 2048;
+  char buf[buflen];
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  struct snapshot *snap = octopass_snapshot_new(&con, json_array());
+  octopass_snapshot_publish(snap);
+  octopass_snapshot_unref(snap);
+
+  status = _nss_octopass_getgrgid_r(con.gid, &grent, buf, buflen, &err);
+  cr_assert_eq(status, NSS_STATUS_SUCCESS);
+  cr_assert_str_eq(grent.gr_name, con.group_name);
+  cr_assert_null(grent.gr_mem[0]);
+
+  status = _nss_octopass_getgrnam_r(con.group_name, &grent, buf, buflen, &err);
+  cr_assert_eq(status, NSS_STATUS_SUCCESS);
+  cr_assert_eq(grent.gr_gid, con.gid);
+  cr_assert_null(grent.gr_mem[0]);
+}
+
+Test(nss_octopass, initgroups_dyn__when_rejected_by_presence, .init = setup)
+{
+  enum nss_status status;
+  long int start = 1;
+  long int size  = 4;
+  gid_t *groups  = calloc(size, sizeof(gid_t));
+  int err        = 0;
+
+  status = _nss_octopass_initgroups_dyn("linyows", 2000, &start, &size, &groups, 0, &err);
+  cr_assert_eq(status, NSS_STATUS_SUCCESS);
+  cr_assert_eq(start, 1);
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  cr_assert_eq(octopass_presence_lookup(&con, "postgres"), 0);
+
+  status = _nss_octopass_initgroups_dyn("postgres", 2000, &start, &size, &groups, 0, &err);
+  cr_assert_eq(err, ENOENT);
+  cr_assert_eq(status, NSS_STATUS_NOTFOUND);
+  cr_assert_eq(start, 1);
+  free(groups);
+}
+
+Test(nss_octopass, initgroups_dyn__when_size_is_zero, .init = setup)
+{
+  long int start = 0;
+  long int size  = 0;
+  gid_t *groups  = NULL;
+  int err        = 0;
+
+  cr_assert_eq(_nss_octopass_initgroups_dyn("linyows", 0, &start, &size, &groups, 0, &err), NSS_STATUS_SUCCESS);
+  cr_assert_eq(start, 1);
+  cr_assert_eq(size, 8);
+  cr_assert_eq(groups[0], 2000);
+  free(groups);
+
+  // Never grown past limit.
+  start  = 0;
+  size   = 0;
+  groups = NULL;
+  cr_assert_eq(_nss_octopass_initgroups_dyn("linyows", 0, &start, &size, &groups, 1, &err), NSS_STATUS_SUCCESS);
+  cr_assert_eq(size, 1);
+  cr_assert_eq(groups[0], 2000);
+  free(groups);
+}
+
 Test(nss_octopass, grent_list, .init = setup)
 {
   enum nss_status status;
@@ -16,15 +16,14 @@
 
 #include "octopass.h"
 
-static pthread_mutex_t OCTOPASS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-static json_t *ent_json_root          = NULL;
-static int ent_json_idx               = 0;
+// Enumeration state is kept per thread, so concurrent enumerations never share a cursor.
+static __thread struct snapshot *ent_snapshot = NULL;
+static __thread json_t *ent_json_root         = NULL;
+static __thread int ent_json_idx              = 0;
 
+// Packs everything into the caller's buffer, nothing is allocated.
 static int pack_passwd_struct(json_t *root, struct passwd *result, char *buffer, size_t buflen, struct config *con)
 {
-  char *next_buf = buffer;
-  size_t bufleft = buflen;
-
   if (!json_is_object(root)) {
     return -1;
   }
@@ -41,71 +40,55 @@ static int pack_passwd_struct(json_t *root, struct passwd *result, char *buffer,
   }
   const json_int_t id = json_integer_value(j_pw_uid);
 
-  memset(buffer, '\0', buflen);
+  size_t name_len  = strlen(login) + 1;
+  int dir_len      = snprintf(NULL, 0, con->home, login) + 1;
+  size_t shell_len = strlen(con->shell) + 1;
 
-  if (bufleft <= strlen(login)) {
+  if (dir_len <= 0 || buflen < name_len + dir_len + shell_len) {
     return -2;
   }
 
-  result->pw_name = strncpy(next_buf, login, bufleft);
-  next_buf += strlen(result->pw_name) + 1;
-  bufleft -= strlen(result->pw_name) + 1;
+  char *next_buf = buffer;
+
+  result->pw_name = memcpy(next_buf, login, name_len);
+  next_buf += name_len;
+
+  result->pw_dir = next_buf;
+  snprintf(next_buf, dir_len, con->home, login);
+  next_buf += dir_len;
+
+  result->pw_shell = memcpy(next_buf, con->shell, shell_len);
 
   result->pw_passwd = "x";
   result->pw_uid    = con->uid_starts + id;
   result->pw_gid    = con->gid;
   result->pw_gecos  = "managed by octopass";
-  char dir[MAXBUF];
-  sprintf(dir, con->home, result->pw_name);
-  result->pw_dir   = strdup(dir);
-  result->pw_shell = strdup(con->shell);
 
   return 0;
 }
 
-enum nss_status _nss_octopass_setpwent_locked(int stayopen)
+// Called to open the passwd file
+enum nss_status _nss_octopass_setpwent(int stayopen)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
-  if (con.syslog) {
-    syslog(LOG_INFO, "%s[L%d] -- stayopen: %d", __func__, __LINE__, stayopen);
-  }
-  int status = octopass_members(&con, &res);
-  
-  // debugging
-  printf("this is about the place when we fail, status:%d",status);
-
-  if (status != 0) {
-    free(res.data);
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
-    }
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
     return NSS_STATUS_UNAVAIL;
   }
-
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-
-  if (!root) {
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
-    }
-    return NSS_STATUS_UNAVAIL;
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- stayopen: %d", __func__, __LINE__, stayopen);
   }
 
-  if (!json_is_array(root)) {
-    json_decref(root);
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
     }
     return NSS_STATUS_UNAVAIL;
   }
 
-  ent_json_root = root;
+  octopass_snapshot_unref(ent_snapshot);
+  ent_snapshot  = snap;
+  ent_json_root = snap->members;
   ent_json_idx  = 0;
 
   if (con.syslog) {
@@ -114,50 +97,25 @@ enum nss_status _nss_octopass_setpwent_locked(int stayopen)
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to open the passwd file
-enum nss_status _nss_octopass_setpwent(int stayopen)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_setpwent_locked(stayopen);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
-
-enum nss_status _nss_octopass_endpwent_locked(void)
+// Called to close the passwd file
+enum nss_status _nss_octopass_endpwent(void)
 {
-  if (ent_json_root) {
-    while (ent_json_root->refcount > 0) {
-      json_decref(ent_json_root);
-    }
-  }
+  octopass_snapshot_unref(ent_snapshot);
 
+  ent_snapshot  = NULL;
   ent_json_root = NULL;
   ent_json_idx  = 0;
 
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to close the passwd file
-enum nss_status _nss_octopass_endpwent(void)
-{
-  enum nss_status ret;
-
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_endpwent_locked();
-  OCTOPASS_UNLOCK();
-
-  return ret;
-}
-
-enum nss_status _nss_octopass_getpwent_r_locked(struct passwd *result, char *buffer, size_t buflen, int *errnop)
+// Called to look up next entry in passwd file
+enum nss_status _nss_octopass_getpwent_r(struct passwd *result, char *buffer, size_t buflen, int *errnop)
 {
   enum nss_status ret = NSS_STATUS_SUCCESS;
 
   if (ent_json_root == NULL) {
-    ret = _nss_octopass_setpwent_locked(0);
+    ret = _nss_octopass_setpwent(0);
   }
 
   if (ret != NSS_STATUS_SUCCESS) {
@@ -171,7 +129,10 @@ enum nss_status _nss_octopass_getpwent_r_locked(struct passwd *result, char *buf
   }
 
   struct config con;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d]", __func__, __LINE__);
   }
@@ -202,45 +163,30 @@ enum nss_status _nss_octopass_getpwent_r_locked(struct passwd *result, char *buf
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to look up next entry in passwd file
-enum nss_status _nss_octopass_getpwent_r(struct passwd *result, char *buffer, size_t buflen, int *errnop)
-{
-  enum nss_status ret;
-
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_getpwent_r_locked(result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return ret;
-}
-
 // Find a passwd by uid
-enum nss_status _nss_octopass_getpwuid_r_locked(uid_t uid, struct passwd *result, char *buffer, size_t buflen,
-                                                int *errnop)
+enum nss_status _nss_octopass_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d] -- uid: %d", __func__, __LINE__, uid);
   }
-  int status = octopass_members(&con, &res);
 
-  if (status != 0) {
-    free(res.data);
+  // System accounts and uids above every member are never ours.
+  long gh_id = (long)uid - con.uid_starts;
+  if (octopass_presence_lookup_id(&con, gh_id) == 0) {
     *errnop = ENOENT;
     if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
     }
-    return NSS_STATUS_UNAVAIL;
+    return NSS_STATUS_NOTFOUND;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-  if (!root) {
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
@@ -248,12 +194,10 @@ enum nss_status _nss_octopass_getpwuid_r_locked(uid_t uid, struct passwd *result
     return NSS_STATUS_UNAVAIL;
   }
 
-  int gh_id = uid - con.uid_starts;
+  json_t *data = octopass_snapshot_member_by_id(snap, gh_id);
 
-  json_t *data = octopass_github_team_member_by_id(gh_id, root);
-
-  if (json_object_size(data) == 0) {
-    json_decref(root);
+  if (!data) {
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -264,7 +208,7 @@ enum nss_status _nss_octopass_getpwuid_r_locked(uid_t uid, struct passwd *result
   int pack_result = pack_passwd_struct(data, result, buffer, buflen, &con);
 
   if (pack_result == -1) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -273,7 +217,7 @@ enum nss_status _nss_octopass_getpwuid_r_locked(uid_t uid, struct passwd *result
   }
 
   if (pack_result == -2) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ERANGE;
     return NSS_STATUS_TRYAGAIN;
   }
@@ -283,47 +227,33 @@ enum nss_status _nss_octopass_getpwuid_r_locked(uid_t uid, struct passwd *result
            result->pw_uid);
   }
 
-  json_decref(root);
+  octopass_snapshot_unref(snap);
   return NSS_STATUS_SUCCESS;
 }
 
-enum nss_status _nss_octopass_getpwuid_r(uid_t uid, struct passwd *result, char *buffer, size_t buflen, int *errnop)
-{
-  enum nss_status ret;
-
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_getpwuid_r_locked(uid, result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return ret;
-}
-
-enum nss_status _nss_octopass_getpwnam_r_locked(const char *name, struct passwd *result, char *buffer, size_t buflen,
-                                                int *errnop)
+// Find a passwd by name
+enum nss_status _nss_octopass_getpwnam_r(const char *name, struct passwd *result, char *buffer, size_t buflen,
+                                         int *errnop)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d] -- name: %s", __func__, __LINE__, name);
   }
-  int status = octopass_members(&con, &res);
 
-  if (status != 0) {
-    free(res.data);
+  if (octopass_presence_lookup(&con, name) == 0) {
     *errnop = ENOENT;
     if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
     }
-    return NSS_STATUS_UNAVAIL;
+    return NSS_STATUS_NOTFOUND;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-  if (!root) {
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
@@ -331,10 +261,10 @@ enum nss_status _nss_octopass_getpwnam_r_locked(const char *name, struct passwd
     return NSS_STATUS_UNAVAIL;
   }
 
-  json_t *data = octopass_github_team_member_by_name((char *)name, root);
+  json_t *data = octopass_snapshot_member_by_name(snap, name);
 
   if (!data) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -345,7 +275,7 @@ enum nss_status _nss_octopass_getpwnam_r_locked(const char *name, struct passwd
   int pack_result = pack_passwd_struct(data, result, buffer, buflen, &con);
 
   if (pack_result == -1) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -354,7 +284,7 @@ enum nss_status _nss_octopass_getpwnam_r_locked(const char *name, struct passwd
   }
 
   if (pack_result == -2) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ERANGE;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "TRYAGAIN");
@@ -367,19 +297,6 @@ enum nss_status _nss_octopass_getpwnam_r_locked(const char *name, struct passwd
            result->pw_uid);
   }
 
-  json_decref(root);
+  octopass_snapshot_unref(snap);
   return NSS_STATUS_SUCCESS;
 }
-
-// Find a passwd by name
-enum nss_status _nss_octopass_getpwnam_r(const char *name, struct passwd *result, char *buffer, size_t buflen,
-                                         int *errnop)
-{
-  enum nss_status ret;
-
-  OCTOPASS_LOCK();
-  ret = _nss_octopass_getpwnam_r_locked(name, result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return ret;
-}
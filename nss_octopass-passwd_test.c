@@ -20,6 +20,29 @@
 
 extern void setup(void);
 
+Test(nss_octopass, pack_passwd_struct)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  json_t *member = json_pack("{s:s, s:i}", "login", "linyows", "id", 72049);
+  struct passwd pwent;
+
+  // "linyows\0" + "/home/linyows\0" + "/bin/bash\0"
+  char buf[32];
+  cr_assert_eq(pack_passwd_struct(member, &pwent, buf, sizeof(buf), &con), 0);
+  cr_assert_str_eq(pwent.pw_name, "linyows");
+  cr_assert_str_eq(pwent.pw_dir, "/home/linyows");
+  cr_assert_str_eq(pwent.pw_shell, "/bin/bash");
+  cr_assert_eq(pwent.pw_uid, 74049);
+  cr_assert(pwent.pw_shell >= buf && pwent.pw_shell < buf + sizeof(buf));
+
+  cr_assert_eq(pack_passwd_struct(member, &pwent, buf, sizeof(buf) - 1, &con), -2);
+
+  json_decref(member);
+}
+
 Test(nss_octopass, getpwnam_r, .init = setup)
 {
   enum nss_status status;
@@ -57,6 +80,27 @@ Test(nss_octopass, getpwnam_r__when_team_member_not_found, .init = setup)
   cr_assert_eq(status, NSS_STATUS_NOTFOUND);
 }
 
+Test(nss_octopass, getpwnam_r__when_rejected_by_presence, .init = setup)
+{
+  enum nss_status status;
+  struct passwd pwent;
+  int err    = 0;
+  int buflen = 2048;
+  char buf[buflen];
+
+  status = _nss_octopass_getpwnam_r("linyows", &pwent, buf, buflen, &err);
+  cr_assert_eq(status, NSS_STATUS_SUCCESS);
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  cr_assert_eq(octopass_presence_lookup(&con, "linyows"), 1);
+  cr_assert_eq(octopass_presence_lookup(&con, "postgres"), 0);
+
+  status = _nss_octopass_getpwnam_r("postgres", &pwent, buf, buflen, &err);
+  cr_assert_eq(err, ENOENT);
+  cr_assert_eq(status, NSS_STATUS_NOTFOUND);
+}
+
 Test(nss_octopass, pwent_list, .init = setup)
 {
   enum nss_status status;
@@ -189,3 +233,30 @@ Test(nss_octopass, getpwuid_r, .init = setup)
   cr_assert_str_eq(pwent.pw_dir, "/home/linyows");
   cr_assert_str_eq(pwent.pw_shell, "/bin/bash");
 }
+
+Test(nss_octopass, getpwuid_r__when_out_of_range, .init = setup)
+{
+  enum nss_status status;
+  struct passwd pwent;
+  int err    = 0;
+  int buflen = 2048;
+  char buf[buflen];
+
+  status = _nss_octopass_getpwuid_r(0, &pwent, buf, buflen, &err);
+  cr_assert_eq(err, ENOENT);
+  cr_assert_eq(status, NSS_STATUS_NOTFOUND);
+
+  status = _nss_octopass_getpwuid_r(74049, &pwent, buf, buflen, &err);
+  cr_assert_eq(status, NSS_STATUS_SUCCESS);
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  cr_assert_eq(octopass_presence_lookup_id(&con, 72049), 1);
+  cr_assert_eq(octopass_presence_lookup_id(&con, -1), 0);
+  cr_assert_eq(octopass_presence_lookup_id(&con, 0x7fffffff), 0);
+
+  err    = 0;
+  status = _nss_octopass_getpwuid_r(2000 + 0x7fffffff, &pwent, buf, buflen, &err);
+  cr_assert_eq(err, ENOENT);
+  cr_assert_eq(status, NSS_STATUS_NOTFOUND);
+}
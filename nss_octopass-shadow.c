@@ -16,15 +16,27 @@
 
 #include "octopass.h"
 
-static pthread_mutex_t OCTOPASS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-static json_t *ent_json_root          = NULL;
-static int ent_json_idx               = 0;
-
+// Enumeration state is kept per thread, so concurrent enumerations never share a cursor.
+static __thread struct snapshot *ent_snapshot = NULL;
+static __thread json_t *ent_json_root         = NULL;
+static __thread int ent_json_idx              = 0;
+
+// Every field but the login is the same for all members.
+static const struct spwd shadow_template = {
+  .sp_namp   = NULL,
+  .sp_pwdp   = "!!",
+  .sp_lstchg = -1,
+  .sp_min    = -1,
+  .sp_max    = -1,
+  .sp_warn   = -1,
+  .sp_inact  = -1,
+  .sp_expire = -1,
+  .sp_flag   = ~0ul,
+};
+
+// Packs everything into the caller's buffer, nothing is allocated.
 static int pack_shadow_struct(json_t *root, struct spwd *result, char *buffer, size_t buflen)
 {
-  char *next_buf = buffer;
-  size_t bufleft = buflen;
-
   if (!json_is_object(root)) {
     return -1;
   }
@@ -35,116 +47,62 @@ static int pack_shadow_struct(json_t *root, struct spwd *result, char *buffer, s
   }
   const char *login = json_string_value(j_sp_name);
 
-  memset(buffer, '\0', buflen);
-
-  if (bufleft <= strlen(login)) {
+  size_t name_len = strlen(login) + 1;
+  if (buflen < name_len) {
     return -2;
   }
-  result->sp_namp = strncpy(next_buf, login, bufleft);
-  next_buf += strlen(result->sp_namp) + 1;
-  bufleft -= strlen(result->sp_namp) + 1;
-
-  result->sp_pwdp   = "!!";
-  result->sp_lstchg = -1;
-  result->sp_min    = -1;
-  result->sp_max    = -1;
-  result->sp_warn   = -1;
-  result->sp_inact  = -1;
-  result->sp_expire = -1;
-  result->sp_flag   = ~0ul;
+  *result         = shadow_template;
+  result->sp_namp = memcpy(buffer, login, name_len);
 
   return 0;
 }
 
-enum nss_status _nss_octopass_setspent_locked(int stayopen)
+// Called to open the shadow file
+enum nss_status _nss_octopass_setspent(int stayopen)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
-  if (con.syslog) {
-    syslog(LOG_INFO, "%s[L%d] -- stya_open: %d", __func__, __LINE__, stayopen);
-  }
-  int status = octopass_members(&con, &res);
-
-  if (status != 0) {
-    free(res.data);
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
-    }
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
     return NSS_STATUS_UNAVAIL;
   }
-
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-
-  if (!root) {
-    if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
-    }
-    return NSS_STATUS_UNAVAIL;
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- stya_open: %d", __func__, __LINE__, stayopen);
   }
 
-  if (!json_is_array(root)) {
-    json_decref(root);
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
     }
     return NSS_STATUS_UNAVAIL;
   }
 
-  ent_json_root = root;
+  octopass_snapshot_unref(ent_snapshot);
+  ent_snapshot  = snap;
+  ent_json_root = snap->members;
   ent_json_idx  = 0;
 
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to open the shadow file
-enum nss_status _nss_octopass_setspent(int stayopen)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_setspent_locked(stayopen);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
-
-enum nss_status _nss_octopass_endspent_locked(void)
+// Called to close the shadow file
+enum nss_status _nss_octopass_endspent(void)
 {
-  if (ent_json_root) {
-    while (ent_json_root->refcount > 0) {
-      json_decref(ent_json_root);
-    }
-  }
+  octopass_snapshot_unref(ent_snapshot);
 
+  ent_snapshot  = NULL;
   ent_json_root = NULL;
   ent_json_idx  = 0;
 
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to close the shadow file
-enum nss_status _nss_octopass_endspent(void)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_endspent_locked();
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
-
-enum nss_status _nss_octopass_getspent_r_locked(struct spwd *result, char *buffer, size_t buflen, int *errnop)
+// Called to look up next entry in shadow file
+enum nss_status _nss_octopass_getspent_r(struct spwd *result, char *buffer, size_t buflen, int *errnop)
 {
   enum nss_status status = NSS_STATUS_SUCCESS;
 
   if (ent_json_root == NULL) {
-    status = _nss_octopass_setspent_locked(0);
+    status = _nss_octopass_setspent(0);
   }
 
   if (status != NSS_STATUS_SUCCESS) {
@@ -178,44 +136,29 @@ enum nss_status _nss_octopass_getspent_r_locked(struct spwd *result, char *buffe
   return NSS_STATUS_SUCCESS;
 }
 
-// Called to look up next entry in shadow file
-enum nss_status _nss_octopass_getspent_r(struct spwd *result, char *buffer, size_t buflen, int *errnop)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_getspent_r_locked(result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
-
-enum nss_status _nss_octopass_getspnam_r_locked(const char *name, struct spwd *result, char *buffer, size_t buflen,
-                                                int *errnop)
+// Find a shadow by name
+enum nss_status _nss_octopass_getspnam_r(const char *name, struct spwd *result, char *buffer, size_t buflen,
+                                         int *errnop)
 {
-  json_t *root;
-  json_error_t error;
-
   struct config con;
-  struct response res;
-  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+  if (octopass_config_load_cached(&con, OCTOPASS_CONFIG_FILE) != 0) {
+    *errnop = ENOENT;
+    return NSS_STATUS_UNAVAIL;
+  }
   if (con.syslog) {
     syslog(LOG_INFO, "%s[L%d] -- name: %s", __func__, __LINE__, name);
   }
-  int status = octopass_members(&con, &res);
 
-  if (status != 0) {
-    free(res.data);
+  if (octopass_presence_lookup(&con, name) == 0) {
     *errnop = ENOENT;
     if (con.syslog) {
-      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
     }
-    return NSS_STATUS_UNAVAIL;
+    return NSS_STATUS_NOTFOUND;
   }
 
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
-  if (!root) {
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  if (snap == NULL) {
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "UNAVAIL");
@@ -223,10 +166,10 @@ enum nss_status _nss_octopass_getspnam_r_locked(const char *name, struct spwd *r
     return NSS_STATUS_UNAVAIL;
   }
 
-  json_t *data = octopass_github_team_member_by_name((char *)name, root);
+  json_t *data = octopass_snapshot_member_by_name(snap, name);
 
-  if (json_object_size(data) == 0) {
-    json_decref(root);
+  if (!data) {
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -237,7 +180,7 @@ enum nss_status _nss_octopass_getspnam_r_locked(const char *name, struct spwd *r
   int pack_result = pack_shadow_struct(data, result, buffer, buflen);
 
   if (pack_result == -1) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ENOENT;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "NOTFOUND");
@@ -246,7 +189,7 @@ enum nss_status _nss_octopass_getspnam_r_locked(const char *name, struct spwd *r
   }
 
   if (pack_result == -2) {
-    json_decref(root);
+    octopass_snapshot_unref(snap);
     *errnop = ERANGE;
     if (con.syslog) {
       syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "TRYAGAIN");
@@ -258,19 +201,6 @@ enum nss_status _nss_octopass_getspnam_r_locked(const char *name, struct spwd *r
     syslog(LOG_INFO, "%s[L%d] -- status: %s, sp_namp: %s", __func__, __LINE__, "SUCCESS", result->sp_namp);
   }
 
-  json_decref(root);
+  octopass_snapshot_unref(snap);
   return NSS_STATUS_SUCCESS;
 }
-
-// Find a shadow by name
-enum nss_status _nss_octopass_getspnam_r(const char *name, struct spwd *result, char *buffer, size_t buflen,
-                                         int *errnop)
-{
-  enum nss_status status;
-
-  OCTOPASS_LOCK();
-  status = _nss_octopass_getspnam_r_locked(name, result, buffer, buflen, errnop);
-  OCTOPASS_UNLOCK();
-
-  return status;
-}
@@ -16,6 +16,27 @@
 
 #include "octopass.h"
 
+// The published snapshot. The mutex only guards taking a reference to it;
+// fetching and parsing is serialized separately so readers never wait on I/O.
+static pthread_mutex_t OCTOPASS_SNAPSHOT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t OCTOPASS_REFRESH_MUTEX  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t OCTOPASS_CURL_MUTEX     = PTHREAD_MUTEX_INITIALIZER;
+static CURL *octopass_curl                     = NULL;
+// One idle connection to the redis backend, reused by the commands of this process.
+static pthread_mutex_t OCTOPASS_RESP_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static int octopass_resp_fd                = -1;
+static pid_t octopass_resp_pid             = 0;
+static char octopass_resp_server[MAXBUF];
+static char octopass_resp_password[MAXBUF];
+// The config as last parsed, see octopass_config_load_cached.
+static pthread_mutex_t OCTOPASS_CONFIG_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static struct config octopass_config_cache;
+static bool octopass_config_cache_loaded = false;
+static time_t octopass_config_cache_checked;
+static char octopass_config_cache_file[MAXBUF];
+static struct stat octopass_config_cache_st;
+static struct snapshot *octopass_snapshot      = NULL;
+
 static size_t write_response_callback(void *contents, size_t size, size_t nmemb, void *userp)
 {
   size_t realsize      = size * nmemb;
@@ -40,6 +61,36 @@ static size_t write_response_callback(void *contents, size_t size, size_t nmemb,
   return realsize;
 }
 
+// OK: 0
+// NG: -1
+int octopass_buffer_append(struct buffer *buf, const char *str, size_t len)
+{
+  if (buf->len + len + 1 > buf->cap) {
+    size_t cap = buf->cap > 0 ? buf->cap : 256;
+    while (buf->len + len + 1 > cap) {
+      cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+      fprintf(stderr, "Not enough memory (realloc returned NULL)\n");
+      return -1;
+    }
+    buf->data = data;
+    buf->cap  = cap;
+  }
+
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+
+  return 0;
+}
+
+int octopass_buffer_append_str(struct buffer *buf, const char *str)
+{
+  return octopass_buffer_append(buf, str, strlen(str));
+}
+
 void octopass_remove_quotes(char *s)
 {
   if (s == NULL) {
@@ -67,9 +118,8 @@ const char *octopass_truncate(const char *str, int len)
 
 const char *octopass_masking(const char *token)
 {
-  int len = 5;
-  char s[strlen(token) + 1];
-  sprintf(s, "%s ************ REDACTED ************", octopass_truncate(token, len));
+  char s[MAXBUF];
+  snprintf(s, sizeof(s), "%.5s ************ REDACTED ************", token);
   char *mask = strdup(s);
   return mask;
 }
@@ -181,36 +231,81 @@ void octopass_override_config_by_env(struct config *con)
   }
 }
 
-void octopass_config_loading(struct config *con, char *filename)
+// Copies the names matched in value to names, up to OCTOPASS_MAX_NAMES of them.
+// Returns the number copied.
+static int octopass_config_names(const char *key, char *value, char *pattern, char names[][OCTOPASS_MAX_NAME])
+{
+  char **matched = calloc(MAXBUF, sizeof(char *));
+  if (matched == NULL) {
+    return 0;
+  }
+
+  int count = octopass_match(value, pattern, matched);
+  int n     = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    if (n < OCTOPASS_MAX_NAMES && strlen(matched[i]) < OCTOPASS_MAX_NAME) {
+      snprintf(names[n++], OCTOPASS_MAX_NAME, "%s", matched[i]);
+    } else {
+      fprintf(stderr, "Ignored %s: %s\n", key, matched[i]);
+    }
+    free(matched[i]);
+  }
+  free(matched);
+
+  return n;
+}
+
+// Reads the config, a malformed line is skipped, so this is safe inside PAM and NSS callers.
+// OK: 0
+// NG: -1, the file cannot be read
+int octopass_config_load(struct config *con, char *filename)
 {
   memset(con->endpoint, '\0', sizeof(con->endpoint));
   memset(con->token, '\0', sizeof(con->token));
   memset(con->organization, '\0', sizeof(con->organization));
   memset(con->team, '\0', sizeof(con->team));
+  memset(con->owner, '\0', sizeof(con->owner));
   memset(con->repository, '\0', sizeof(con->repository));
   memset(con->permission, '\0', sizeof(con->permission));
   memset(con->group_name, '\0', sizeof(con->group_name));
   memset(con->home, '\0', sizeof(con->home));
   memset(con->shell, '\0', sizeof(con->shell));
+  memset(con->webhook_secret, '\0', sizeof(con->webhook_secret));
+  memset(con->bundle_key, '\0', sizeof(con->bundle_key));
+  memset(con->bundle_public_key, '\0', sizeof(con->bundle_public_key));
+  memset(con->cache_server, '\0', sizeof(con->cache_server));
+  memcpy(con->cache_server, OCTOPASS_REDIS_SERVER, strlen(OCTOPASS_REDIS_SERVER));
+  memset(con->proxy_listen, '\0', sizeof(con->proxy_listen));
+  memcpy(con->proxy_listen, OCTOPASS_PROXY_LISTEN, strlen(OCTOPASS_PROXY_LISTEN));
+  memset(con->cache_password, '\0', sizeof(con->cache_password));
   con->uid_starts         = (long)2000;
   con->gid                = (long)2000;
   con->cache              = (long)500;
   con->syslog             = false;
+  con->refresh            = false;
   con->shared_users_count = 0;
+  con->teams_count        = 0;
+  con->webhook_port       = OCTOPASS_WEBHOOK_PORT;
+  con->incremental        = false;
+  con->resync             = OCTOPASS_RESYNC;
+  con->proxy_port         = OCTOPASS_PROXY_PORT;
+  con->backend            = &octopass_file_backend;
+  con->cache_max_entries  = OCTOPASS_CACHE_MAX_ENTRIES;
+  con->cache_max_size     = OCTOPASS_CACHE_MAX_SIZE;
+  con->cache_compress     = false;
 
   FILE *file = fopen(filename, "r");
 
   if (file == NULL) {
     fprintf(stderr, "Config not found: %s\n", filename);
-    exit(1);
+    return -1;
   }
 
   char line[MAXBUF];
 
   while (fgets(line, sizeof(line), file) != NULL) {
-    if (strlen(line) != sizeof(line) - 1) {
-      line[strlen(line) - 1] = '\0';
-    }
+    line[strcspn(line, "\r\n")] = '\0';
 
     if (strlen(line) == 0) {
       continue;
@@ -219,11 +314,14 @@ void octopass_config_loading(struct config *con, char *filename)
     char *lasts;
     char *key   = strtok_r(line, DELIM, &lasts);
     char *value = strtok_r(NULL, DELIM, &lasts);
+    if (key == NULL || value == NULL) {
+      continue;
+    }
 
-    if (strcmp(key, "SharedUsers") == 0 && strlen(lasts) > 0) {
-      char v[strlen(value) + strlen(lasts)];
-      sprintf(v, "%s %s", value, lasts);
-      value = strdup(v);
+    char joined[MAXBUF];
+    if ((strcmp(key, "SharedUsers") == 0 || strcmp(key, "Teams") == 0) && strlen(lasts) > 0) {
+      snprintf(joined, sizeof(joined), "%s %s", value, lasts);
+      value = joined;
     } else {
       octopass_remove_quotes(value);
     }
@@ -255,6 +353,50 @@ void octopass_config_loading(struct config *con, char *filename)
       con->gid = atoi(value);
     } else if (strcmp(key, "Cache") == 0) {
       con->cache = (long)atoi(value);
+    } else if (strcmp(key, "WebhookSecret") == 0) {
+      memcpy(con->webhook_secret, value, strlen(value));
+    } else if (strcmp(key, "WebhookPort") == 0) {
+      con->webhook_port = atol(value);
+    } else if (strcmp(key, "Incremental") == 0) {
+      if (strcmp(value, "true") == 0) {
+        con->incremental = true;
+      } else {
+        con->incremental = false;
+      }
+    } else if (strcmp(key, "Resync") == 0) {
+      con->resync = atol(value);
+    } else if (strcmp(key, "BundleKey") == 0) {
+      memcpy(con->bundle_key, value, strlen(value));
+    } else if (strcmp(key, "BundlePublicKey") == 0) {
+      memcpy(con->bundle_public_key, value, strlen(value));
+    } else if (strcmp(key, "ProxyPort") == 0) {
+      con->proxy_port = atol(value);
+    } else if (strcmp(key, "ProxyListen") == 0) {
+      memset(con->proxy_listen, '\0', sizeof(con->proxy_listen));
+      memcpy(con->proxy_listen, value, strlen(value));
+    } else if (strcmp(key, "CacheBackend") == 0) {
+      const struct cache_backend *backend = octopass_cache_backend(value);
+      if (backend == NULL) {
+        fprintf(stderr, "Unknown cache backend: %s\n", value);
+      } else {
+        con->backend = backend;
+      }
+    } else if (strcmp(key, "CacheServer") == 0) {
+      memset(con->cache_server, '\0', sizeof(con->cache_server));
+      memcpy(con->cache_server, value, strlen(value));
+    } else if (strcmp(key, "CachePassword") == 0) {
+      memset(con->cache_password, '\0', sizeof(con->cache_password));
+      memcpy(con->cache_password, value, strlen(value));
+    } else if (strcmp(key, "CacheMaxEntries") == 0) {
+      con->cache_max_entries = atol(value);
+    } else if (strcmp(key, "CacheMaxSize") == 0) {
+      con->cache_max_size = atoll(value);
+    } else if (strcmp(key, "CacheCompress") == 0) {
+      if (strcmp(value, "true") == 0) {
+        con->cache_compress = true;
+      } else {
+        con->cache_compress = false;
+      }
     } else if (strcmp(key, "Syslog") == 0) {
       if (strcmp(value, "true") == 0) {
         con->syslog = true;
@@ -263,8 +405,16 @@ void octopass_config_loading(struct config *con, char *filename)
       }
     } else if (strcmp(key, "SharedUsers") == 0) {
       char *pattern           = "\"([A-z0-9_-]+)\"";
-      con->shared_users       = calloc(MAXBUF, sizeof(char *));
-      con->shared_users_count = octopass_match(value, pattern, con->shared_users);
+      con->shared_users_count = octopass_config_names(key, value, pattern, con->shared_users);
+    } else if (strcmp(key, "Teams") == 0) {
+      char *pattern    = "\"([A-z0-9_.-]+:[0-9]+)\"";
+      con->teams_count = octopass_config_names(key, value, pattern, con->teams);
+      int i;
+      for (i = 0; i < con->teams_count; i++) {
+        char *colon       = strrchr(con->teams[i], ':');
+        *colon            = '\0';
+        con->teams_gid[i] = atol(colon + 1);
+      }
     }
   }
 
@@ -307,23 +457,110 @@ void octopass_config_loading(struct config *con, char *filename)
   if (con->syslog) {
     const char *pg_name = "octopass";
     openlog(pg_name, LOG_CONS | LOG_PID, LOG_USER);
-    syslog(LOG_INFO, "config {endpoint: %s, token: %s, organization: %s, team: %s, owner: %s, repository: %s, permission: %s "
-                     "syslog: %d, uid_starts: %ld, gid: %ld, group_name: %s, home: %s, shell: %s, cache: %ld}",
-           con->endpoint, octopass_masking(con->token), con->organization, con->team, con->owner, con->repository, con->permission,
+    // The same form as octopass_masking, without allocating on every load.
+    syslog(LOG_INFO,
+           "config {endpoint: %s, token: %.5s ************ REDACTED ************, organization: %s, team: %s, owner: %s, "
+           "repository: %s, permission: %s syslog: %d, uid_starts: %ld, gid: %ld, group_name: %s, home: %s, shell: %s, "
+           "cache: %ld}",
+           con->endpoint, con->token, con->organization, con->team, con->owner, con->repository, con->permission,
            con->syslog, con->uid_starts, con->gid, con->group_name, con->home, con->shell, con->cache);
   }
+
+  return 0;
 }
 
-void octopass_export_file(char *file, char *data)
+void octopass_config_loading(struct config *con, char *filename)
+{
+  if (octopass_config_load(con, filename) != 0) {
+    exit(1);
+  }
+}
+
+// Loads the config as octopass_config_load does, parsing the file only when it
+// has been replaced or modified since the last call of this process. The file
+// is looked at once a second at most, and the environment only when it is
+// parsed. For NSS, that is called for every lookup.
+// OK: 0
+// NG: -1
+int octopass_config_load_cached(struct config *con, char *filename)
+{
+  pthread_mutex_lock(&OCTOPASS_CONFIG_MUTEX);
+  time_t now = time(NULL);
+  int status = 0;
+  if (!octopass_config_cache_loaded || octopass_config_cache_checked != now ||
+      strcmp(octopass_config_cache_file, filename) != 0) {
+    struct stat st = { 0 };
+    if (stat(filename, &st) != 0 || !octopass_config_cache_loaded ||
+        strcmp(octopass_config_cache_file, filename) != 0 || st.st_dev != octopass_config_cache_st.st_dev ||
+        st.st_ino != octopass_config_cache_st.st_ino || st.st_size != octopass_config_cache_st.st_size ||
+        st.st_mtim.tv_sec != octopass_config_cache_st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != octopass_config_cache_st.st_mtim.tv_nsec) {
+      status                       = octopass_config_load(&octopass_config_cache, filename);
+      octopass_config_cache_loaded = status == 0 && strlen(filename) < sizeof(octopass_config_cache_file);
+      if (octopass_config_cache_loaded) {
+        strcpy(octopass_config_cache_file, filename);
+        octopass_config_cache_st = st;
+      }
+    }
+    octopass_config_cache_checked = now;
+  }
+  if (status == 0 && octopass_config_cache.syslog) {
+    openlog("octopass", LOG_CONS | LOG_PID, LOG_USER);
+  }
+  if (status == 0) {
+    *con = octopass_config_cache;
+  }
+  pthread_mutex_unlock(&OCTOPASS_CONFIG_MUTEX);
+
+  return status;
+}
+
+// Write to a temporary file and rename it into place, so that readers
+// running concurrently never see a partially written file.
+// OK: 0
+// NG: -1
+int octopass_export_data_with_mode(char *file, const void *data, size_t size, mode_t mode)
 {
-  FILE *fp = fopen(file, "w");
+  char tmp[strlen(file) + 8];
+  sprintf(tmp, "%s.XXXXXX", file);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    return -1;
+  }
+  fchmod(fd, mode);
+
+  FILE *fp = fdopen(fd, "w");
   if (!fp) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  size_t written = fwrite(data, 1, size, fp);
+  if (fclose(fp) != 0 || written != size) {
+    unlink(tmp);
+    return -1;
+  }
+
+  if (rename(tmp, file) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+int octopass_export_data(char *file, const void *data, size_t size)
+{
+  return octopass_export_data_with_mode(file, data, size, 0644);
+}
+
+void octopass_export_file(char *file, char *data)
+{
+  if (octopass_export_data(file, data, strlen(data)) != 0) {
     fprintf(stderr, "File open failure: %s\n", file);
     exit(1);
-    return;
   }
-  fprintf(fp, "%s", data);
-  fclose(fp);
 }
 
 const char *octopass_import_file(char *file)
@@ -333,38 +570,93 @@ const char *octopass_import_file(char *file)
     fprintf(stderr, "File open failure: %s\n", file);
     exit(1);
   }
-  char line[MAXBUF];
-  char *data;
 
-  if ((data = malloc(OCTOPASS_MAX_BUFFER_SIZE)) != NULL) {
-    data[0] = '\0';
-  } else {
-    fprintf(stderr, "Malloc failed\n");
+  struct buffer data = { 0 };
+  char chunk[8192];
+  size_t n;
+
+  if (octopass_buffer_append(&data, "", 0) != 0) {
     fclose(fp);
     return NULL;
   }
-
-  while (fgets(line, sizeof(line), fp) != NULL) {
-    strcat(data, strdup(line));
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    if (octopass_buffer_append(&data, chunk, n) != 0) {
+      free(data.data);
+      fclose(fp);
+      return NULL;
+    }
   }
   fclose(fp);
-  const char *res = strdup(data);
-  free(data);
 
-  return res;
+  return data.data;
 }
 
-void octopass_github_request_without_cache(struct config *con, char *url, struct response *res, char *token)
+// Takes the idle handle when there is one, so that sequential requests of a
+// process, such as a PAM module or the NSS module, reuse its connection.
+static CURL *octopass_curl_acquire(void)
+{
+  pthread_mutex_lock(&OCTOPASS_CURL_MUTEX);
+  CURL *hnd     = octopass_curl;
+  octopass_curl = NULL;
+  pthread_mutex_unlock(&OCTOPASS_CURL_MUTEX);
+
+  if (hnd == NULL) {
+    return curl_easy_init();
+  }
+  curl_easy_reset(hnd);
+
+  return hnd;
+}
+
+static void octopass_curl_release(CURL *hnd)
+{
+  pthread_mutex_lock(&OCTOPASS_CURL_MUTEX);
+  if (octopass_curl == NULL) {
+    octopass_curl = hnd;
+    hnd           = NULL;
+  }
+  pthread_mutex_unlock(&OCTOPASS_CURL_MUTEX);
+
+  if (hnd != NULL) {
+    curl_easy_cleanup(hnd);
+  }
+}
+
+// Copies the ETag of a response to userp, a MAXBUF buffer.
+static size_t etag_header_callback(char *buffer, size_t size, size_t nitems, void *userp)
+{
+  size_t realsize = size * nitems;
+  size_t len      = strlen("ETag:");
+
+  if (realsize > len && strncasecmp(buffer, "ETag:", len) == 0) {
+    const char *v   = buffer + len;
+    const char *end = buffer + realsize;
+    while (v < end && (*v == ' ' || *v == '\t')) {
+      v++;
+    }
+    while (end > v && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) {
+      end--;
+    }
+    snprintf((char *)userp, MAXBUF, "%.*s", (int)(end - v), v);
+  }
+
+  return realsize;
+}
+
+// Requests url, revalidating with etag when it is not empty, so that GitHub
+// answers 304 without a body. etag is a MAXBUF buffer and receives the ETag
+// of the response. NULL skips both.
+void octopass_github_request_with_etag(struct config *con, char *url, struct response *res, char *token, char *etag)
 {
   if (con->syslog) {
     syslog(LOG_INFO, "http get -- %s", url);
   }
 
-  char auth[64];
+  char auth[MAXBUF + 32];
   if (token == NULL) {
     token = con->token;
   }
-  sprintf(auth, "Authorization: token %s", token);
+  snprintf(auth, sizeof(auth), "Authorization: token %s", token);
 
   CURL *hnd;
   CURLcode result;
@@ -374,16 +666,28 @@ void octopass_github_request_without_cache(struct config *con, char *url, struct
   res->httpstatus            = (long *)0;
 
   headers = curl_slist_append(headers, auth);
+  if (etag != NULL && strlen(etag) > 0) {
+    char match[MAXBUF + 32];
+    snprintf(match, sizeof(match), "If-None-Match: %s", etag);
+    headers = curl_slist_append(headers, match);
+  }
 
-  hnd = curl_easy_init();
+  hnd = octopass_curl_acquire();
   curl_easy_setopt(hnd, CURLOPT_URL, url);
   curl_easy_setopt(hnd, CURLOPT_NOPROGRESS, 1L);
   curl_easy_setopt(hnd, CURLOPT_USERAGENT, OCTOPASS_VERSION_WITH_NAME);
   curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, headers);
   curl_easy_setopt(hnd, CURLOPT_MAXREDIRS, 3L);
   curl_easy_setopt(hnd, CURLOPT_TIMEOUT, 15L);
+  // Any encoding cURL can decode, members are highly repetitive JSON.
+  curl_easy_setopt(hnd, CURLOPT_ACCEPT_ENCODING, "");
   curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, write_response_callback);
   curl_easy_setopt(hnd, CURLOPT_WRITEDATA, res);
+  if (etag != NULL) {
+    etag[0] = '\0';
+    curl_easy_setopt(hnd, CURLOPT_HEADERFUNCTION, etag_header_callback);
+    curl_easy_setopt(hnd, CURLOPT_HEADERDATA, etag);
+  }
 
   result = curl_easy_perform(hnd);
 
@@ -398,10 +702,26 @@ void octopass_github_request_without_cache(struct config *con, char *url, struct
     }
   }
 
-  curl_easy_cleanup(hnd);
+  octopass_curl_release(hnd);
   curl_slist_free_all(headers);
 }
 
+void octopass_github_request_without_cache(struct config *con, char *url, struct response *res, char *token)
+{
+  octopass_github_request_with_etag(con, url, res, token, NULL);
+}
+
+// Where the response of a url is cached, the name of its file in the file store.
+void octopass_cache_key(struct config *con, char *url, char *key, size_t len)
+{
+  char *base = curl_escape(url, strlen(url));
+  snprintf(key, len, "%s-%.6s", base, con->token);
+  curl_free(base);
+}
+
+// Answers from the cache while it is fresher than Cache. A stale response is
+// fetched again by one process at a time, the others answer from the cache
+// meanwhile, as they do when GitHub cannot be reached.
 void octopass_github_request(struct config *con, char *url, struct response *res)
 {
   char *token = NULL;
@@ -410,49 +730,52 @@ void octopass_github_request(struct config *con, char *url, struct response *res
     return;
   }
 
-  char *base = curl_escape(url, strlen(url));
-  char f[strlen(base) + strlen(con->token) + 6];
-  char *file = f;
-  sprintf(f, "%s/%s-%s", OCTOPASS_CACHE_DIR, base, octopass_truncate(con->token, 6));
+  const struct cache_backend *cache = con->backend;
+  char key[strlen(url) * 3 + 16];
+  octopass_cache_key(con, url, key, sizeof(key));
 
-  FILE *fp      = fopen(file, "r");
   long *ok_code = (long *)200;
+  long age      = cache->age(con, key);
+  bool fetch    = age == -1;
+  int locked    = -1;
+  if (age > con->cache || con->refresh) {
+    locked = cache->lock(con, key, OCTOPASS_CACHE_LOCK_TTL);
+    fetch  = locked != 1 || con->refresh;
+  }
 
-  if (fp == NULL) {
+  if (fetch) {
     octopass_github_request_without_cache(con, url, res, token);
     if (res->httpstatus == ok_code) {
-      octopass_export_file(file, res->data);
+      cache->put(con, key, res->data, con->cache + OCTOPASS_CACHE_RETENTION);
     }
-  } else {
-    fclose(fp);
-
-    struct stat statbuf;
-    if (stat(file, &statbuf) != -1) {
-      unsigned long now  = time(NULL);
-      unsigned long diff = now - statbuf.st_mtime;
-      if (diff > con->cache) {
-        octopass_github_request_without_cache(con, url, res, token);
-        if (res->httpstatus == ok_code) {
-          octopass_export_file(file, res->data);
-          return;
-        }
-      }
+    if (locked == 0) {
+      cache->unlock(con, key);
     }
-
-    if (con->syslog) {
-      syslog(LOG_INFO, "use cache: %s", file);
+    if (res->httpstatus == ok_code || age == -1) {
+      return;
     }
+  }
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "use cache: %s", key);
+  }
 
-    res->data = (char *)octopass_import_file(file);
-    res->size = strlen(res->data);
+  char *data = cache->get(con, key);
+  if (data == NULL && !fetch) {
+    octopass_github_request_without_cache(con, url, res, token);
+    return;
+  }
+  if (data != NULL) {
+    if (fetch) {
+      free(res->data);
+    }
+    res->data = data;
+    res->size = strlen(data);
   }
 }
 
 int octopass_github_team_id(char *team_name, char *data)
 {
-   printf("inside octopass_github_team_id which does not get us the right id of %s ...\n",team_name);
-   printf("datadump:\n");
-   printf("%s\n",data);
   json_error_t error;
   json_t *teams = json_loads(data, 0, &error);
   json_t *team;
@@ -461,18 +784,14 @@ int octopass_github_team_id(char *team_name, char *data)
   json_array_foreach(teams, i, team)
   {
     if (!json_is_object(team)) {
-       printf("seems like we're iterating i=%d, but never getting a match ...\n",i);
       continue;
     }
-    printf("are we iterating over teams ?%d\n",i);
     const char *name = json_string_value(json_object_get(team, "name"));
-    printf("are we iterating over teams ?%s\n",name);
     if (name != NULL && strcmp(team_name, name) == 0) {
       const json_int_t id = json_integer_value(json_object_get(team, "id"));
       return id;
     }
   }
-  // AAA!!! team name didn't match!!! who de fu gave a team name with complex formatting ?!
   return -1;
 }
 
@@ -510,18 +829,13 @@ json_t *octopass_github_team_member_by_id(int gh_id, json_t *members)
 
 int octopass_team_id(struct config *con)
 {
-   
-   printf("just inside octopass_team_id - seems like it fails actually ...\n");
   char url[strlen(con->endpoint) + strlen(con->organization) + 64];
   sprintf(url, "%sorgs/%s/teams?per_page=100", con->endpoint, con->organization);
-   printf("url: %s\n",url);
 
   struct response res;
   octopass_github_request(con, url, &res);
-   printf("right after the request \n");
 
   if (!res.data) {
-    printf("right near the Request failure message\n");
     fprintf(stderr, "Request failure\n");
     if (con->syslog) {
       closelog();
@@ -529,9 +843,7 @@ int octopass_team_id(struct config *con)
     return -1;
   }
 
-    printf("about to get an id ...\n");
   int id = octopass_github_team_id(con->team, res.data);
-    printf(" id ... %d\n",id);
   free(res.data);
   return id;
 }
@@ -556,22 +868,16 @@ int octopass_team_members_by_team_id(struct config *con, int team_id, struct res
 
 int octopass_team_members(struct config *con, struct response *res)
 {
-   printf("Here we go - we're inside octopass_team_members - beginning\n");
-   
   int team_id = octopass_team_id(con);
   if (team_id == -1) {
     return -1;
   }
-   printf("inside octopass_team_members team_id acquired\n");
-   printf("team_id = %d",team_id);
 
   int status = octopass_team_members_by_team_id(con, team_id, res);
   if (status == -1) {
     return -1;
   }
 
-   printf("we never get here i guess ...\n");
-
   return 0;
 }
 
@@ -650,118 +956,2685 @@ int octopass_members(struct config *con, struct response *res)
   if (strlen(con->repository) != 0) {
     return octopass_repository_collaborators(con, res);
   } else {
-     printf("hey from octopass_members function: team branch, not collabs one ...\n\n");
     return octopass_team_members(con, res);
   }
 }
 
-// OK: 0
-// NG: 1
-int octopass_autentication_with_token(struct config *con, char *user, char *token)
+// FNV-1a
+uint64_t octopass_hash(const char *str, uint64_t seed)
 {
-  struct response res;
-  char url[strlen(con->endpoint) + strlen("user") + 1];
-  sprintf(url, "%suser", con->endpoint);
-  octopass_github_request_without_cache(con, url, &res, token);
-
-  long *ok_code = (long *)200;
-  if (res.httpstatus == ok_code) {
-    json_t *root;
-    json_error_t error;
-    root              = json_loads(res.data, 0, &error);
-    const char *login = json_string_value(json_object_get(root, "login"));
-
-    if (strcmp(login, user) == 0) {
-      return 0;
-    }
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+  for (; *str != '\0'; str++) {
+    h ^= (unsigned char)*str;
+    h *= 0x100000001b3ULL;
   }
+  return h;
+}
 
-  if (con->syslog) {
-    closelog();
+// Without padding, as in ssh fingerprints. out needs 4 * ((len + 2) / 3) + 1 bytes.
+void octopass_base64_encode(const unsigned char *data, size_t len, char *out)
+{
+  int n = EVP_EncodeBlock((unsigned char *)out, data, len);
+  while (n > 0 && out[n - 1] == '=') {
+    out[--n] = '\0';
   }
-  return 1;
 }
 
-const char *octopass_only_keys(char *data)
+// With or without padding. out needs 3 * (len / 4) + 3 bytes.
+// Returns the decoded length, or -1 when str is not base64.
+long octopass_base64_decode(const char *str, size_t len, unsigned char *out)
 {
-  json_t *root;
-  json_error_t error;
-  root = json_loads(data, 0, &error);
-
-  char *keys = calloc(OCTOPASS_MAX_BUFFER_SIZE, sizeof(char *));
+  while (len > 0 && str[len - 1] == '=') {
+    len--;
+  }
+  if (len % 4 == 1 || memchr(str, '\0', len) != NULL) {
+    return -1;
+  }
 
-  size_t i;
-  for (i = 0; i < json_array_size(root); i++) {
-    json_t *obj     = json_array_get(root, i);
-    const char *key = json_string_value(json_object_get(obj, "key"));
-    strcat(keys, strdup(key));
-    strcat(keys, "\n");
+  // EVP_DecodeBlock only takes whole groups of 4, so the padding is put back.
+  size_t pad     = (4 - len % 4) % 4;
+  char *complete = malloc(len + pad);
+  if (complete == NULL) {
+    return -1;
   }
+  memcpy(complete, str, len);
+  memset(complete + len, '=', pad);
+  int n = EVP_DecodeBlock(out, (unsigned char *)complete, len + pad);
+  free(complete);
 
-  const char *res = strdup(keys);
-  free(keys);
+  return n < 0 ? -1 : n - (long)pad;
+}
 
-  return res;
+// Frames data as magic (8 bytes), the little endian size of data in 8 bytes
+// and data compressed with zlib at level, as bundles and compressed responses are.
+// Returns NULL when it cannot be compressed.
+unsigned char *octopass_compress(const char *magic, const char *data, size_t len, int level, size_t *out_len)
+{
+  uLongf zlen        = compressBound(len);
+  unsigned char *out = malloc(16 + zlen);
+  if (out == NULL || compress2(out + 16, &zlen, (const unsigned char *)data, len, level) != Z_OK) {
+    free(out);
+    return NULL;
+  }
+  memcpy(out, magic, 8);
+  int i;
+  for (i = 0; i < 8; i++) {
+    out[8 + i] = (uint64_t)len >> (i * 8) & 0xff;
+  }
+  *out_len = 16 + zlen;
+  return out;
 }
 
-const char *octopass_github_user_keys(struct config *con, char *user)
+// Whether data is framed by octopass_compress with magic.
+bool octopass_is_compressed(const char *magic, const char *data, size_t len)
 {
-  struct response res;
-  char url[strlen(con->endpoint) + strlen(user) + 64];
-  sprintf(url, "%susers/%s/keys?per_page=100", con->endpoint, user);
-  octopass_github_request(con, url, &res);
+  return len >= 16 && memcmp(data, magic, 8) == 0;
+}
 
-  if (!res.data) {
-    fprintf(stderr, "Request failure\n");
-    if (con->syslog) {
-      closelog();
-    }
+// Returns the data of a frame of magic, terminated, or NULL when it is not
+// one or would be larger than max.
+char *octopass_uncompress(const char *magic, const char *data, size_t len, size_t max, size_t *out_len)
+{
+  if (!octopass_is_compressed(magic, data, len)) {
     return NULL;
   }
 
-  return octopass_only_keys(res.data);
+  uint64_t raw = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    raw |= (uint64_t)(unsigned char)data[8 + i] << (i * 8);
+  }
+  uLongf plen = raw;
+  char *out   = raw <= max ? malloc(raw + 1) : NULL;
+  if (out == NULL || uncompress((unsigned char *)out, &plen, (const unsigned char *)data + 16, len - 16) != Z_OK ||
+      plen != raw) {
+    free(out);
+    return NULL;
+  }
+  out[raw]  = '\0';
+  *out_len = raw;
+  return out;
 }
 
-const char *octopass_github_team_members_keys(struct config *con)
+// Compresses a response for a client that accepts gzip.
+// Returns NULL when it cannot be compressed.
+char *octopass_gzip(const char *data, size_t len, size_t *out_len)
 {
-  json_t *root;
-  json_error_t error;
+  z_stream zs = { 0 };
+  if (deflateInit2(&zs, OCTOPASS_CACHE_COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+  size_t cap = deflateBound(&zs, len);
+  char *out  = malloc(cap);
+  zs.next_in   = (unsigned char *)data;
+  zs.avail_in  = len;
+  zs.next_out  = (unsigned char *)out;
+  zs.avail_out = cap;
+  if (out == NULL || deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&zs);
+    free(out);
+    return NULL;
+  }
+  *out_len = zs.total_out;
+  deflateEnd(&zs);
+  return out;
+}
 
-  struct response res;
-  int status = octopass_team_members(con, &res);
+size_t octopass_presence_size(struct presence *p)
+{
+  return sizeof(struct presence) + p->nbits / 8;
+}
 
-  if (status != 0) {
-    free(res.data);
-    return NULL;
+struct presence *octopass_presence_new(uint64_t key_hash, json_t *members)
+{
+  size_t count = json_array_size(members);
+  size_t nbits = count * OCTOPASS_PRESENCE_BITS_PER_LOGIN;
+  if (nbits < 64) {
+    nbits = 64;
   }
-  root = json_loads(res.data, 0, &error);
-  free(res.data);
+  nbits = (nbits + 7) & ~(size_t)7;
 
-  if (!json_is_array(root)) {
+  struct presence *p = calloc(1, sizeof(struct presence) + nbits / 8);
+  if (p == NULL) {
     return NULL;
   }
+  memcpy(p->magic, OCTOPASS_PRESENCE_MAGIC, sizeof(p->magic));
+  p->key_hash = key_hash;
+  p->nbits    = nbits;
+  p->hashes   = OCTOPASS_PRESENCE_HASHES;
+  p->max_id   = -1;
 
-  char *members_keys = calloc(OCTOPASS_MAX_BUFFER_SIZE, sizeof(char *));
-  size_t cnt         = json_array_size(root);
-  int i              = 0;
+  size_t i;
+  for (i = 0; i < count; i++) {
+    json_t *member = json_array_get(members, i);
+    json_t *j_id   = json_object_get(member, "id");
+    if (json_is_integer(j_id) && json_integer_value(j_id) > p->max_id) {
+      p->max_id = json_integer_value(j_id);
+    }
 
-  for (i = 0; i < cnt; i++) {
-    json_t *j_obj = json_array_get(root, i);
-    if (!json_is_object(j_obj)) {
+    const char *login = json_string_value(json_object_get(member, "login"));
+    if (login == NULL) {
       continue;
     }
-    json_t *j_name = json_object_get(j_obj, "login");
-    if (!json_is_string(j_name)) {
-      continue;
+    uint64_t h1 = octopass_hash(login, 0);
+    uint64_t h2 = octopass_hash(login, h1) | 1;
+    uint32_t k;
+    for (k = 0; k < p->hashes; k++) {
+      uint64_t bit = (h1 + k * h2) % p->nbits;
+      p->bits[bit / 8] |= 1 << (bit % 8);
     }
+  }
 
-    const char *login = json_string_value(j_name);
-    const char *keys  = octopass_github_user_keys(con, (char *)login);
-    strcat(members_keys, strdup(keys));
+  return p;
+}
+
+// Maybe present: 1
+// Absent: 0
+int octopass_presence_test(struct presence *p, const char *name)
+{
+  uint64_t h1 = octopass_hash(name, 0);
+  uint64_t h2 = octopass_hash(name, h1) | 1;
+  uint32_t k;
+  for (k = 0; k < p->hashes; k++) {
+    uint64_t bit = (h1 + k * h2) % p->nbits;
+    if ((p->bits[bit / 8] & (1 << (bit % 8))) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void octopass_presence_file(uint64_t key_hash, char *file, size_t len)
+{
+  snprintf(file, len, "%s/presence-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)key_hash);
+}
+
+// Reads the filter written for the config, unless it is older than the cache.
+// Returns NULL when there is none to trust.
+struct presence *octopass_presence_import(struct config *con, uint64_t key_hash)
+{
+  char file[MAXBUF];
+  octopass_presence_file(key_hash, file, sizeof(file));
+
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    return NULL;
+  }
+
+  struct stat statbuf;
+  struct presence head;
+  if (fstat(fileno(fp), &statbuf) == -1 || (unsigned long)(time(NULL) - statbuf.st_mtime) > con->cache ||
+      fread(&head, sizeof(head), 1, fp) != 1 || memcmp(head.magic, OCTOPASS_PRESENCE_MAGIC, sizeof(head.magic)) != 0 ||
+      head.key_hash != key_hash || head.nbits == 0 || head.nbits % 8 != 0 ||
+      statbuf.st_size != (off_t)(sizeof(head) + head.nbits / 8)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  struct presence *p = malloc(sizeof(head) + head.nbits / 8);
+  if (p == NULL || fread(p->bits, head.nbits / 8, 1, fp) != 1) {
+    free(p);
+    fclose(fp);
+    return NULL;
   }
+  memcpy(p, &head, sizeof(head));
+  fclose(fp);
+
+  return p;
+}
 
-  const char *result = strdup(members_keys);
-  free(members_keys);
+struct snapshot *octopass_snapshot_ref(struct snapshot *snap)
+{
+  if (snap != NULL) {
+    __sync_fetch_and_add(&snap->refcount, 1);
+  }
+  return snap;
+}
 
-  return (strlen(result) > 0) ? result : NULL;
+void octopass_snapshot_unref(struct snapshot *snap)
+{
+  if (snap == NULL) {
+    return;
+  }
+
+  if (__sync_sub_and_fetch(&snap->refcount, 1) == 0) {
+    int i;
+    for (i = 0; i < snap->teams_count; i++) {
+      free(snap->teams[i].name);
+      json_decref(snap->teams[i].members);
+      json_decref(snap->teams[i].logins);
+    }
+    free(snap->teams);
+    json_decref(snap->team_by_name);
+    json_decref(snap->team_by_gid);
+    json_decref(snap->member_by_name);
+    json_decref(snap->member_by_id);
+    json_decref(snap->members);
+    free(snap->presence);
+    free(snap->key);
+    free(snap);
+  }
+}
+
+// Identifies the member list a config resolves to.
+void octopass_snapshot_key(struct config *con, char *key, size_t len)
+{
+  int n = snprintf(key, len, "%s|%s|%s|%s|%s|%s|%s|%s|%ld", con->endpoint, con->token, con->organization, con->team,
+                   con->owner, con->repository, con->permission, con->group_name, con->gid);
+
+  int i;
+  for (i = 0; i < con->teams_count && n > 0 && n < len; i++) {
+    n += snprintf(key + n, len - n, "|%s:%ld", con->teams[i], con->teams_gid[i]);
+  }
+}
+
+// Replaced each time a webhook changes the members of the config, so that
+// processes holding a snapshot notice it before the cache expires.
+void octopass_generation_file(uint64_t key_hash, char *file, size_t len)
+{
+  snprintf(file, len, "%s/generation-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)key_hash);
+}
+
+// Both are zero while there is no generation file.
+void octopass_generation_stat(uint64_t key_hash, ino_t *ino, struct timespec *mtime)
+{
+  char file[MAXBUF];
+  octopass_generation_file(key_hash, file, sizeof(file));
+
+  struct stat statbuf;
+  if (stat(file, &statbuf) == -1) {
+    *ino = 0;
+    memset(mtime, 0, sizeof(struct timespec));
+    return;
+  }
+  *ino   = statbuf.st_ino;
+  *mtime = statbuf.st_mtim;
+}
+
+// OK: 0
+// NG: -1
+int octopass_generation_bump(struct config *con)
+{
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+
+  char file[MAXBUF];
+  octopass_generation_file(octopass_hash(key, 0), file, sizeof(file));
+
+  char data[32];
+  snprintf(data, sizeof(data), "%ld\n", (long)time(NULL));
+
+  return octopass_export_data(file, data, strlen(data));
+}
+
+struct snapshot *octopass_snapshot_current(void)
+{
+  pthread_mutex_lock(&OCTOPASS_SNAPSHOT_MUTEX);
+  struct snapshot *snap = octopass_snapshot_ref(octopass_snapshot);
+  pthread_mutex_unlock(&OCTOPASS_SNAPSHOT_MUTEX);
+
+  return snap;
+}
+
+void octopass_snapshot_publish(struct snapshot *snap)
+{
+  pthread_mutex_lock(&OCTOPASS_SNAPSHOT_MUTEX);
+  struct snapshot *old = octopass_snapshot;
+  octopass_snapshot    = octopass_snapshot_ref(snap);
+  pthread_mutex_unlock(&OCTOPASS_SNAPSHOT_MUTEX);
+
+  octopass_snapshot_unref(old);
+}
+
+// Usable: 1
+// Expired, invalidated or for another config: 0
+int octopass_snapshot_is_usable(struct config *con, struct snapshot *snap, char *key)
+{
+  if (snap == NULL || snap->key == NULL || strcmp(snap->key, key) != 0) {
+    return 0;
+  }
+
+  unsigned long diff = time(NULL) - snap->loaded_at;
+  if (diff > con->cache) {
+    return 0;
+  }
+
+  ino_t ino;
+  struct timespec mtime;
+  octopass_generation_stat(octopass_hash(key, 0), &ino, &mtime);
+
+  return ino == snap->generation_ino && mtime.tv_sec == snap->generation_mtime.tv_sec &&
+                 mtime.tv_nsec == snap->generation_mtime.tv_nsec
+             ? 1
+             : 0;
+}
+
+// Adds a group to an unpublished snapshot, taking ownership of its members.
+void octopass_snapshot_add_team(struct snapshot *snap, const char *name, long gid, json_t *members)
+{
+  struct team *team = &snap->teams[snap->teams_count];
+  team->name        = strdup(name);
+  team->gid         = gid;
+  team->members     = members;
+  team->logins      = json_object();
+  team->logins_len  = 0;
+
+  size_t i;
+  for (i = 0; i < json_array_size(members); i++) {
+    const char *login = json_string_value(json_object_get(json_array_get(members, i), "login"));
+    if (login != NULL) {
+      json_object_set_new(team->logins, login, json_true());
+      team->logins_len += strlen(login) + 1;
+    }
+  }
+
+  char gid_key[32];
+  sprintf(gid_key, "%ld", gid);
+  json_object_set_new(snap->team_by_name, name, json_integer(snap->teams_count));
+  json_object_set_new(snap->team_by_gid, gid_key, json_integer(snap->teams_count));
+  snap->teams_count++;
+}
+
+// Takes ownership of the parsed member list and precomputes what lookups need.
+struct snapshot *octopass_snapshot_new(struct config *con, json_t *members)
+{
+  struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+  if (snap == NULL) {
+    json_decref(members);
+    return NULL;
+  }
+
+  snap->teams = calloc(con->teams_count + 1, sizeof(struct team));
+  if (snap->teams == NULL) {
+    free(snap);
+    json_decref(members);
+    return NULL;
+  }
+  snap->team_by_name   = json_object();
+  snap->team_by_gid    = json_object();
+  snap->member_by_name = json_object();
+  snap->member_by_id   = json_object();
+  snap->members        = members;
+  json_incref(members);
+
+  size_t i;
+  for (i = 0; i < json_array_size(members); i++) {
+    json_t *member = json_array_get(members, i);
+    json_t *j_name = json_object_get(member, "login");
+    json_t *j_id   = json_object_get(member, "id");
+    if (!json_is_string(j_name) || !json_is_integer(j_id)) {
+      continue;
+    }
+
+    char id_key[32];
+    sprintf(id_key, "%ld", (long)json_integer_value(j_id));
+    json_object_set(snap->member_by_name, json_string_value(j_name), member);
+    json_object_set(snap->member_by_id, id_key, member);
+  }
+
+  octopass_snapshot_add_team(snap, con->group_name, con->gid, members);
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  snap->key       = strdup(key);
+  snap->presence  = octopass_presence_new(octopass_hash(key, 0), members);
+  snap->loaded_at = time(NULL);
+  snap->refcount  = 1;
+  octopass_generation_stat(octopass_hash(key, 0), &snap->generation_ino, &snap->generation_mtime);
+
+  return snap;
+}
+
+// Returns NULL when the login is not a member.
+json_t *octopass_snapshot_member_by_name(struct snapshot *snap, const char *name)
+{
+  return json_object_get(snap->member_by_name, name);
+}
+
+json_t *octopass_snapshot_member_by_id(struct snapshot *snap, long gh_id)
+{
+  char id_key[32];
+  sprintf(id_key, "%ld", gh_id);
+
+  return json_object_get(snap->member_by_id, id_key);
+}
+
+struct team *octopass_snapshot_team_by_name(struct snapshot *snap, const char *name)
+{
+  json_t *idx = json_object_get(snap->team_by_name, name);
+  if (!json_is_integer(idx)) {
+    return NULL;
+  }
+  return &snap->teams[json_integer_value(idx)];
+}
+
+struct team *octopass_snapshot_team_by_gid(struct snapshot *snap, long gid)
+{
+  char gid_key[32];
+  sprintf(gid_key, "%ld", gid);
+
+  json_t *idx = json_object_get(snap->team_by_gid, gid_key);
+  if (!json_is_integer(idx)) {
+    return NULL;
+  }
+  return &snap->teams[json_integer_value(idx)];
+}
+
+// Fetches the members of each configured team in turn, on the pooled cURL handle.
+// A team that cannot be fetched is left out of the snapshot.
+void octopass_snapshot_load_teams(struct config *con, struct snapshot *snap)
+{
+  struct config *team_con = malloc(sizeof(struct config));
+  if (team_con == NULL) {
+    return;
+  }
+  memcpy(team_con, con, sizeof(struct config));
+
+  int i;
+  for (i = 0; i < con->teams_count; i++) {
+    memset(team_con->team, '\0', sizeof(team_con->team));
+    strncpy(team_con->team, con->teams[i], sizeof(team_con->team) - 1);
+
+    struct response res = { 0 };
+    json_error_t error;
+    json_t *members = NULL;
+    if (octopass_team_members(team_con, &res) == 0) {
+      members = json_loads(res.data, 0, &error);
+    }
+    free(res.data);
+
+    if (!json_is_array(members)) {
+      if (con->syslog) {
+        syslog(LOG_INFO, "team members not available: %s", con->teams[i]);
+      }
+      json_decref(members);
+      continue;
+    }
+    octopass_snapshot_add_team(snap, con->teams[i], con->teams_gid[i], members);
+  }
+
+  free(team_con);
+}
+
+// Fetch and parse the member list. Returns NULL when it is not available.
+struct snapshot *octopass_snapshot_load(struct config *con)
+{
+  json_error_t error;
+  struct response res = { 0 };
+
+  // Taken before fetching, so that an invalidation during the fetch is not missed.
+  char key[MAXBUF * 8];
+  ino_t ino;
+  struct timespec mtime;
+  octopass_snapshot_key(con, key, sizeof(key));
+  octopass_generation_stat(octopass_hash(key, 0), &ino, &mtime);
+
+  int status = octopass_members(con, &res);
+  if (status != 0) {
+    free(res.data);
+    return NULL;
+  }
+
+  json_t *root = json_loads(res.data, 0, &error);
+  free(res.data);
+
+  if (!json_is_array(root)) {
+    json_decref(root);
+    return NULL;
+  }
+
+  struct snapshot *snap = octopass_snapshot_new(con, root);
+  if (snap != NULL) {
+    snap->generation_ino   = ino;
+    snap->generation_mtime = mtime;
+  }
+  if (snap != NULL && con->teams_count > 0 && strlen(con->repository) == 0) {
+    octopass_snapshot_load_teams(con, snap);
+  }
+
+  if (snap != NULL && snap->presence != NULL && con->cache > 0) {
+    char file[MAXBUF];
+    octopass_presence_file(snap->presence->key_hash, file, sizeof(file));
+    if (octopass_export_data(file, snap->presence, octopass_presence_size(snap->presence)) != 0 && con->syslog) {
+      syslog(LOG_INFO, "presence filter not written: %s", file);
+    }
+  }
+
+  return snap;
+}
+
+// Returns a reference to the published snapshot, refreshing it once expired.
+// While one thread refreshes, the others keep reading the previous snapshot,
+// and a failed refresh keeps serving it. Returns NULL when nothing is available.
+struct snapshot *octopass_snapshot_acquire(struct config *con)
+{
+  if (con->cache == 0) {
+    return octopass_snapshot_load(con);
+  }
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+
+  struct snapshot *snap = octopass_snapshot_current();
+  if (octopass_snapshot_is_usable(con, snap, key)) {
+    return snap;
+  }
+
+  if (snap != NULL && snap->key != NULL && strcmp(snap->key, key) == 0) {
+    if (pthread_mutex_trylock(&OCTOPASS_REFRESH_MUTEX) != 0) {
+      return snap;
+    }
+  } else {
+    octopass_snapshot_unref(snap);
+    pthread_mutex_lock(&OCTOPASS_REFRESH_MUTEX);
+
+    // Another thread may have published it while this one was waiting.
+    snap = octopass_snapshot_current();
+    if (octopass_snapshot_is_usable(con, snap, key)) {
+      pthread_mutex_unlock(&OCTOPASS_REFRESH_MUTEX);
+      return snap;
+    }
+    if (snap != NULL && strcmp(snap->key, key) != 0) {
+      octopass_snapshot_unref(snap);
+      snap = NULL;
+    }
+  }
+
+  struct snapshot *fresh = octopass_snapshot_load(con);
+  if (fresh != NULL) {
+    octopass_snapshot_publish(fresh);
+  }
+  pthread_mutex_unlock(&OCTOPASS_REFRESH_MUTEX);
+
+  if (fresh == NULL) {
+    return snap;
+  }
+
+  octopass_snapshot_unref(snap);
+  return fresh;
+}
+
+// Returns the presence filter to trust for the config: the one of the fresh
+// published snapshot, or the filter file when the process has none yet.
+// Release it with octopass_presence_release. Returns NULL when there is none.
+struct presence *octopass_presence_acquire(struct config *con, struct snapshot **holder)
+{
+  *holder = NULL;
+  if (con->cache == 0) {
+    return NULL;
+  }
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+
+  struct snapshot *snap = octopass_snapshot_current();
+  if (octopass_snapshot_is_usable(con, snap, key) && snap->presence != NULL) {
+    *holder = snap;
+    return snap->presence;
+  }
+  octopass_snapshot_unref(snap);
+
+  return octopass_presence_import(con, octopass_hash(key, 0));
+}
+
+void octopass_presence_release(struct presence *p, struct snapshot *holder)
+{
+  if (holder != NULL) {
+    octopass_snapshot_unref(holder);
+  } else {
+    free(p);
+  }
+}
+
+// Checks a login before anything is loaded.
+// Maybe a member: 1
+// Not a member: 0
+// No filter to trust: -1
+int octopass_presence_lookup(struct config *con, const char *name)
+{
+  struct snapshot *holder;
+  struct presence *p = octopass_presence_acquire(con, &holder);
+  if (p == NULL) {
+    return -1;
+  }
+
+  int found = octopass_presence_test(p, name);
+  octopass_presence_release(p, holder);
+
+  return found;
+}
+
+// Checks a github id against the largest one of the members.
+// Maybe a member: 1
+// Not a member: 0
+// No filter to trust: -1
+int octopass_presence_lookup_id(struct config *con, long gh_id)
+{
+  if (gh_id < 0) {
+    return 0;
+  }
+
+  struct snapshot *holder;
+  struct presence *p = octopass_presence_acquire(con, &holder);
+  if (p == NULL) {
+    return -1;
+  }
+
+  int found = gh_id <= p->max_id ? 1 : 0;
+  octopass_presence_release(p, holder);
+
+  return found;
+}
+
+// OK: 0
+// NG: 1
+// Not verified, such as when GitHub cannot be reached: -1
+int octopass_verify_token(struct config *con, char *user, char *token)
+{
+  struct response res = { 0 };
+  char url[strlen(con->endpoint) + strlen("user") + 1];
+  sprintf(url, "%suser", con->endpoint);
+  octopass_github_request_without_cache(con, url, &res, token);
+
+  long code  = (long)res.httpstatus;
+  int status = (code == 0 || code >= 500) ? -1 : 1;
+  if (code == 200) {
+    json_t *root;
+    json_error_t error;
+    root              = json_loads(res.data, 0, &error);
+    const char *login = json_string_value(json_object_get(root, "login"));
+
+    if (login != NULL && strcmp(login, user) == 0) {
+      status = 0;
+    }
+    json_decref(root);
+  }
+  free(res.data);
+
+  return status;
+}
+
+void octopass_token_file(char *user, char *file, size_t len)
+{
+  char *name = curl_escape(user, strlen(user));
+  snprintf(file, len, "%s/%s", OCTOPASS_TOKEN_CACHE_DIR, name);
+  curl_free(name);
+}
+
+// Returns how long ago the token of the user was verified,
+// or -1 when no entry matches it.
+long octopass_token_cache_check(char *user, char *token)
+{
+  char file[MAXBUF * 4];
+  octopass_token_file(user, file, sizeof(file));
+
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  // Entries anyone else could have written or read are not trusted.
+  struct stat statbuf;
+  if (fstat(fileno(fp), &statbuf) == -1 || statbuf.st_uid != geteuid() || (statbuf.st_mode & 077) != 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  char hash[MAXBUF];
+  long verified_at;
+  int matched = fscanf(fp, "%1023s %ld", hash, &verified_at);
+  fclose(fp);
+  if (matched != 2) {
+    return -1;
+  }
+
+  struct crypt_data data;
+  memset(&data, 0, sizeof(data));
+  char *computed = crypt_r(token, hash, &data);
+  if (computed == NULL || strlen(computed) != strlen(hash)) {
+    return -1;
+  }
+
+  unsigned char diff = 0;
+  size_t i;
+  for (i = 0; i < strlen(hash); i++) {
+    diff |= computed[i] ^ hash[i];
+  }
+  if (diff != 0) {
+    return -1;
+  }
+
+  long age = time(NULL) - verified_at;
+  return age < 0 ? -1 : age;
+}
+
+// Stores a salted SHA-512 crypt of the token, never the token itself.
+// OK: 0
+// NG: -1
+int octopass_token_cache_store(char *user, char *token)
+{
+  if (mkdir(OCTOPASS_TOKEN_CACHE_DIR, 0700) == -1 && errno != EEXIST) {
+    return -1;
+  }
+
+  unsigned char random[12];
+  FILE *fp = fopen("/dev/urandom", "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  size_t n = fread(random, 1, sizeof(random), fp);
+  fclose(fp);
+  if (n != sizeof(random)) {
+    return -1;
+  }
+
+  char salt[sizeof(random) / 3 * 4 + 1];
+  octopass_base64_encode(random, sizeof(random), salt);
+  char *c;
+  for (c = salt; *c != '\0'; c++) {
+    if (*c == '+') {
+      *c = '.';
+    }
+  }
+
+  char setting[64];
+  snprintf(setting, sizeof(setting), "$6$rounds=10000$%s", salt);
+
+  struct crypt_data data;
+  memset(&data, 0, sizeof(data));
+  char *hash = crypt_r(token, setting, &data);
+  if (hash == NULL || hash[0] == '*') {
+    return -1;
+  }
+
+  char entry[MAXBUF];
+  snprintf(entry, sizeof(entry), "%s %ld\n", hash, (long)time(NULL));
+
+  char file[MAXBUF * 4];
+  octopass_token_file(user, file, sizeof(file));
+
+  return octopass_export_data_with_mode(file, entry, strlen(entry), 0600);
+}
+
+void octopass_token_cache_remove(char *user)
+{
+  char file[MAXBUF * 4];
+  octopass_token_file(user, file, sizeof(file));
+  unlink(file);
+}
+
+// Verifies the token again and updates the cache entry accordingly.
+// Returns the status of octopass_verify_token.
+int octopass_token_cache_refresh(struct config *con, char *user, char *token)
+{
+  int status = octopass_verify_token(con, user, token);
+  if (status == 0) {
+    octopass_token_cache_store(user, token);
+  } else if (status == 1) {
+    octopass_token_cache_remove(user);
+  }
+  return status;
+}
+
+// Checks a user with what is already at hand, the presence filter and the
+// published snapshot, without loading anything in the process of the caller.
+// Member: 1
+// Not a member: 0
+// Unknown, such as when no snapshot is published: -1
+int octopass_is_member(struct config *con, char *user)
+{
+  if (octopass_presence_lookup(con, user) == 0) {
+    return 0;
+  }
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  struct snapshot *snap = octopass_snapshot_current();
+  if (!octopass_snapshot_is_usable(con, snap, key)) {
+    octopass_snapshot_unref(snap);
+    return -1;
+  }
+
+  int found = octopass_snapshot_member_by_name(snap, user) != NULL ? 1 : 0;
+  octopass_snapshot_unref(snap);
+
+  return found;
+}
+
+// Looks a user up in the member list of Team or Repository, through the
+// response cache, without the groups of Teams.
+// Member: 1
+// Not a member: 0
+// Unknown, such as when members cannot be fetched: -1
+int octopass_is_listed_member(struct config *con, char *user)
+{
+  struct response res = { 0 };
+  if (octopass_members(con, &res) != 0) {
+    free(res.data);
+    return -1;
+  }
+
+  json_error_t error;
+  json_t *members = json_loads(res.data, 0, &error);
+  free(res.data);
+  if (!json_is_array(members)) {
+    json_decref(members);
+    return -1;
+  }
+
+  int found = 0;
+  size_t i;
+  for (i = 0; i < json_array_size(members) && !found; i++) {
+    const char *login = json_string_value(json_object_get(json_array_get(members, i), "login"));
+    found             = login != NULL && strcmp(login, user) == 0;
+  }
+  json_decref(members);
+
+  return found;
+}
+
+// Names the presence filter or the published snapshot rule out are never
+// verified, so that guessing against them never reaches GitHub. Otherwise the
+// member list is only read once GitHub verified the token.
+// A token verified within the cache period is accepted without any request.
+// After that, it is verified again in place, since this runs inside sshd or
+// sudo and must not fork, and accepted while GitHub cannot be reached, so
+// that authentication keeps working for OCTOPASS_TOKEN_TTL while GitHub is down.
+// Either way the user has to be in the member list still.
+// OK: 0
+// NG: 1
+int octopass_autentication_with_token(struct config *con, char *user, char *token)
+{
+  int member = octopass_is_member(con, user);
+  if (member == 0) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "not a member: %s", user);
+      closelog();
+    }
+    return 1;
+  }
+
+  if (con->cache > 0) {
+    long age = octopass_token_cache_check(user, token);
+    if (age >= 0 && age <= con->cache) {
+      if (con->syslog) {
+        syslog(LOG_INFO, "use verified token cache: %s", user);
+      }
+      return 0;
+    }
+
+    if (age >= 0 && age <= OCTOPASS_TOKEN_TTL) {
+      int status = octopass_token_cache_refresh(con, user, token);
+      // The same membership rule as a fresh token, or a removed user would keep the entry alive.
+      if (status != 1 && member == -1) {
+        member = octopass_is_listed_member(con, user);
+      }
+      if (status != 1 && member != 1) {
+        octopass_token_cache_remove(user);
+      }
+      if (con->syslog) {
+        syslog(LOG_INFO, "%s: %s",
+               status == 1   ? "token revoked"
+               : member != 1 ? (member == 0 ? "not a member" : "members not available")
+               : status == 0 ? "verified token again"
+                             : "use verified token cache",
+               user);
+      }
+      if ((status == 1 || member != 1) && con->syslog) {
+        closelog();
+      }
+      return status == 1 || member != 1 ? 1 : 0;
+    }
+  }
+
+  int status = octopass_verify_token(con, user, token);
+  // Only a user GitHub vouched for gets the member list looked at.
+  if (status == 0 && member == -1) {
+    member = octopass_is_listed_member(con, user);
+  }
+  if (status == 0 && member != 1) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "%s: %s", member == 0 ? "not a member" : "members not available", user);
+      closelog();
+    }
+    return 1;
+  }
+  if (status == 0 && con->cache > 0) {
+    octopass_token_cache_store(user, token);
+  }
+
+  if (status == 0) {
+    return 0;
+  }
+
+  if (con->syslog) {
+    closelog();
+  }
+  return 1;
+}
+
+// Fingerprint of a base64 key blob, as sshd passes it with %f.
+// fp needs OCTOPASS_FINGERPRINT_LEN bytes.
+// OK: 0
+// NG: -1
+int octopass_key_fingerprint(const char *blob, size_t len, char *fp)
+{
+  unsigned char *raw = malloc(3 * (len / 4) + 3);
+  if (raw == NULL) {
+    return -1;
+  }
+
+  long n = octopass_base64_decode(blob, len, raw);
+  if (n <= 0) {
+    free(raw);
+    return -1;
+  }
+
+  unsigned char digest[32];
+  EVP_Digest(raw, n, digest, NULL, EVP_sha256(), NULL);
+  free(raw);
+
+  strcpy(fp, "SHA256:");
+  octopass_base64_encode(digest, sizeof(digest), fp + strlen("SHA256:"));
+
+  return 0;
+}
+
+// Accepts either a fingerprint (%f) or a key blob (%k).
+// OK: 0
+// NG: -1
+int octopass_fingerprint_arg(const char *arg, char *fp)
+{
+  if (strncmp(arg, "SHA256:", strlen("SHA256:")) == 0) {
+    if (strlen(arg) >= OCTOPASS_FINGERPRINT_LEN) {
+      return -1;
+    }
+    strcpy(fp, arg);
+    return 0;
+  }
+
+  return octopass_key_fingerprint(arg, strlen(arg), fp);
+}
+
+// Writes a "fingerprint login key" line for each line of keys.
+void octopass_fingerprint_index_append(FILE *index, const char *login, const char *keys)
+{
+  const char *line = keys;
+  while (line != NULL && *line != '\0') {
+    const char *end = strchr(line, '\n');
+    size_t line_len = end != NULL ? (size_t)(end - line) : strlen(line);
+
+    // type blob [comment]
+    const char *blob = memchr(line, ' ', line_len);
+    if (blob != NULL) {
+      blob++;
+      const char *blob_end = memchr(blob, ' ', line + line_len - blob);
+      size_t blob_len      = (blob_end != NULL ? blob_end : line + line_len) - blob;
+
+      char fp[OCTOPASS_FINGERPRINT_LEN];
+      if (octopass_key_fingerprint(blob, blob_len, fp) == 0) {
+        fprintf(index, "%s %s %.*s\n", fp, login, (int)line_len, line);
+      }
+    }
+
+    line += line_len;
+    if (*line == '\n') {
+      line++;
+    }
+  }
+}
+
+// Writes the keys of the index whose fingerprint matches.
+// Returns the number of matched keys.
+int octopass_fingerprint_lookup(FILE *index, const char *fp, FILE *out)
+{
+  char line[MAXBUF * 16];
+  size_t fp_len = strlen(fp);
+  int found     = 0;
+
+  while (fgets(line, sizeof(line), index) != NULL) {
+    if (strncmp(line, fp, fp_len) != 0 || line[fp_len] != ' ') {
+      continue;
+    }
+    char *key = strchr(line + fp_len + 1, ' ');
+    if (key != NULL) {
+      fputs(key + 1, out);
+      found++;
+    }
+  }
+
+  return found;
+}
+
+const char *octopass_only_keys(char *data)
+{
+  json_t *root;
+  json_error_t error;
+  root = json_loads(data, 0, &error);
+
+  struct buffer keys = { 0 };
+  if (octopass_buffer_append(&keys, "", 0) != 0) {
+    json_decref(root);
+    return NULL;
+  }
+
+  size_t i;
+  for (i = 0; i < json_array_size(root); i++) {
+    json_t *obj     = json_array_get(root, i);
+    const char *key = json_string_value(json_object_get(obj, "key"));
+    if (key == NULL) {
+      continue;
+    }
+    octopass_buffer_append_str(&keys, key);
+    octopass_buffer_append_str(&keys, "\n");
+  }
+  json_decref(root);
+
+  return keys.data;
+}
+
+const char *octopass_github_user_keys(struct config *con, char *user)
+{
+  struct response res;
+  char url[strlen(con->endpoint) + strlen(user) + 64];
+  sprintf(url, "%susers/%s/keys?per_page=100", con->endpoint, user);
+  octopass_github_request(con, url, &res);
+
+  if (!res.data) {
+    fprintf(stderr, "Request failure\n");
+    if (con->syslog) {
+      closelog();
+    }
+    return NULL;
+  }
+
+  const char *keys = octopass_only_keys(res.data);
+  free(res.data);
+
+  return keys;
+}
+
+// The keys of every member. When index is given, each key is also
+// written to it with octopass_fingerprint_index_append.
+const char *octopass_github_team_members_keys(struct config *con, FILE *index)
+{
+  json_t *root;
+  json_error_t error;
+
+  struct response res;
+  int status = octopass_team_members(con, &res);
+
+  if (status != 0) {
+    free(res.data);
+    return NULL;
+  }
+  root = json_loads(res.data, 0, &error);
+  free(res.data);
+
+  if (!json_is_array(root)) {
+    return NULL;
+  }
+
+  struct buffer members_keys = { 0 };
+  size_t cnt                 = json_array_size(root);
+  int i                      = 0;
+
+  for (i = 0; i < cnt; i++) {
+    json_t *j_obj = json_array_get(root, i);
+    if (!json_is_object(j_obj)) {
+      continue;
+    }
+    json_t *j_name = json_object_get(j_obj, "login");
+    if (!json_is_string(j_name)) {
+      continue;
+    }
+
+    const char *login = json_string_value(j_name);
+    const char *keys  = octopass_github_user_keys(con, (char *)login);
+    if (keys == NULL) {
+      continue;
+    }
+    octopass_buffer_append_str(&members_keys, keys);
+    if (index != NULL) {
+      octopass_fingerprint_index_append(index, login, keys);
+    }
+    free((char *)keys);
+  }
+  json_decref(root);
+
+  if (members_keys.len == 0) {
+    free(members_keys.data);
+    return NULL;
+  }
+
+  return members_keys.data;
+}
+
+static void octopass_rendered_file(struct config *con, char *kind, char *user, char *file, size_t len)
+{
+  char *name = curl_escape(user, strlen(user));
+  snprintf(file, len, "%s/%s-%s-%.6s", OCTOPASS_CACHE_DIR, kind, name, con->token);
+  curl_free(name);
+}
+
+// Rendered authorized_keys of a user, next to the responses in the cache.
+void octopass_keys_file(struct config *con, char *user, char *file, size_t len)
+{
+  octopass_rendered_file(con, "authorized_keys", user, file, len);
+}
+
+// Fingerprint index of the keys a user accepts.
+void octopass_fingerprints_file(struct config *con, char *user, char *file, size_t len)
+{
+  octopass_rendered_file(con, "fingerprints", user, file, len);
+}
+
+// Fresh: 1
+// Expired or missing: 0
+int octopass_file_is_fresh(struct config *con, char *file)
+{
+  struct stat statbuf;
+  if (stat(file, &statbuf) == -1) {
+    return 0;
+  }
+
+  unsigned long diff = time(NULL) - statbuf.st_mtime;
+  return diff > con->cache ? 0 : 1;
+}
+
+// Copies a file to fd in the kernel, falling back to read and write
+// when the output does not support sendfile.
+// OK: 0
+// NG: -1
+int octopass_send_file(char *file, int out_fd)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  off_t offset = 0;
+  while (offset < statbuf.st_size) {
+    ssize_t sent = sendfile(out_fd, fd, &offset, statbuf.st_size - offset);
+    if (sent > 0) {
+      continue;
+    }
+    if (sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (sent == 0 || (errno != EINVAL && errno != ENOSYS)) {
+      close(fd);
+      return -1;
+    }
+
+    char buf[8192];
+    ssize_t n;
+    while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+      char *p = buf;
+      while (n > 0) {
+        ssize_t w = write(out_fd, p, n);
+        if (w == -1 && errno == EINTR) {
+          continue;
+        }
+        if (w <= 0) {
+          close(fd);
+          return -1;
+        }
+        p += w;
+        n -= w;
+        offset += w;
+      }
+    }
+    break;
+  }
+
+  close(fd);
+  return 0;
+}
+
+// Fetches the keys a login accepts and renders them to its authorized_keys
+// and fingerprints files, so that the next lookups are served from them.
+// Shared users accept the keys of every team member.
+// The fingerprint index is returned in index, to be freed by the caller.
+const char *octopass_render_keys(struct config *con, char *user, char **index)
+{
+  const char *keys = NULL;
+  int shared       = 0;
+  size_t index_len = 0;
+
+  *index   = NULL;
+  FILE *fp = open_memstream(index, &index_len);
+
+  int i;
+  for (i = 0; i < con->shared_users_count; i++) {
+    if (strcmp(user, con->shared_users[i]) == 0) {
+      shared = 1;
+      break;
+    }
+  }
+
+  if (shared) {
+    keys = octopass_github_team_members_keys(con, fp);
+  } else {
+    keys = octopass_github_user_keys(con, user);
+    if (keys != NULL && fp != NULL) {
+      octopass_fingerprint_index_append(fp, user, keys);
+    }
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+
+  if (keys != NULL && con->cache > 0) {
+    char file[MAXBUF * 4];
+    octopass_keys_file(con, user, file, sizeof(file));
+    if (octopass_export_data(file, keys, strlen(keys)) != 0 && con->syslog) {
+      syslog(LOG_INFO, "keys not rendered: %s", file);
+    }
+
+    octopass_fingerprints_file(con, user, file, sizeof(file));
+    if (*index != NULL && octopass_export_data(file, *index, index_len) != 0 && con->syslog) {
+      syslog(LOG_INFO, "fingerprints not rendered: %s", file);
+    }
+  }
+
+  return keys;
+}
+
+// Removes everything that lets a login in: the cached keys, the rendered
+// authorized_keys and fingerprints, and the verified token.
+void octopass_purge_user(struct config *con, const char *login)
+{
+  char url[strlen(con->endpoint) + strlen(login) + 64];
+  sprintf(url, "%susers/%s/keys?per_page=100", con->endpoint, login);
+
+  char file[MAXBUF * 4];
+  octopass_cache_key(con, url, file, sizeof(file));
+  con->backend->remove(con, file);
+  octopass_keys_file(con, (char *)login, file, sizeof(file));
+  unlink(file);
+  octopass_fingerprints_file(con, (char *)login, file, sizeof(file));
+  unlink(file);
+  octopass_token_cache_remove((char *)login);
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "purged: %s", login);
+  }
+}
+
+// Sorted logins of the members at the previous refresh, one per line.
+void octopass_members_list_file(struct config *con, char *file, size_t len)
+{
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  snprintf(file, len, "%s/members-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)octopass_hash(key, 0));
+}
+
+static int octopass_login_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Returns the logins of the members sorted, pointing into members.
+static const char **octopass_sorted_logins(json_t *members, size_t *count)
+{
+  const char **logins = calloc(json_array_size(members) + 1, sizeof(char *));
+  if (logins == NULL) {
+    return NULL;
+  }
+
+  size_t i;
+  *count = 0;
+  for (i = 0; i < json_array_size(members); i++) {
+    const char *login = json_string_value(json_object_get(json_array_get(members, i), "login"));
+    if (login != NULL) {
+      logins[(*count)++] = login;
+    }
+  }
+  qsort(logins, *count, sizeof(char *), octopass_login_cmp);
+
+  return logins;
+}
+
+// Compares two sorted login lists in one pass, appending the logins only in
+// after to added and the logins only in before to removed.
+void octopass_members_diff(const char **before, size_t before_count, const char **after, size_t after_count,
+                           json_t *added, json_t *removed)
+{
+  size_t i = 0;
+  size_t j = 0;
+
+  while (i < before_count || j < after_count) {
+    int cmp = i == before_count ? 1 : j == after_count ? -1 : strcmp(before[i], after[j]);
+    if (cmp < 0) {
+      json_array_append_new(removed, json_string(before[i++]));
+    } else if (cmp > 0) {
+      json_array_append_new(added, json_string(after[j++]));
+    } else {
+      i++;
+      j++;
+    }
+  }
+}
+
+// Appends a change to the journal, moving it aside once it grows too large.
+void octopass_journal_append(struct config *con, const char *change, const char *login)
+{
+  struct stat statbuf;
+  if (stat(OCTOPASS_JOURNAL_FILE, &statbuf) == 0 && statbuf.st_size > OCTOPASS_JOURNAL_MAX_SIZE) {
+    rename(OCTOPASS_JOURNAL_FILE, OCTOPASS_JOURNAL_FILE ".old");
+  }
+
+  FILE *fp = fopen(OCTOPASS_JOURNAL_FILE, "a");
+  if (fp == NULL) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "journal not written: %s %s", change, login);
+    }
+    return;
+  }
+
+  char now[32];
+  struct tm tm;
+  time_t t = time(NULL);
+  strftime(now, sizeof(now), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+  fprintf(fp, "%s %s %s %s\n", now, change, con->group_name, login);
+  fclose(fp);
+}
+
+// Compares the members with those of the previous refresh. Keys of added
+// members are fetched ahead when prefetch is set, everything of removed
+// members is purged, and both are written to the journal.
+// Returns the number of changes, or -1 when the previous members cannot be replaced.
+int octopass_members_diff_apply(struct config *con, struct snapshot *snap, bool prefetch)
+{
+  size_t after_count;
+  const char **after = octopass_sorted_logins(snap->members, &after_count);
+  if (after == NULL) {
+    return -1;
+  }
+
+  char file[MAXBUF];
+  octopass_members_list_file(con, file, sizeof(file));
+
+  struct buffer list = { 0 };
+  size_t i;
+  for (i = 0; i < after_count; i++) {
+    octopass_buffer_append_str(&list, after[i]);
+    octopass_buffer_append_str(&list, "\n");
+  }
+
+  // Without a previous list, there is nothing to compare with yet.
+  char *previous      = access(file, R_OK) == 0 ? (char *)octopass_import_file(file) : NULL;
+  json_t *added       = json_array();
+  json_t *removed     = json_array();
+  const char **before = NULL;
+  size_t before_count = 0;
+  if (previous != NULL) {
+    before = calloc(strlen(previous) / 2 + 1, sizeof(char *));
+    char *lasts;
+    char *line;
+    for (line = strtok_r(previous, "\n", &lasts); before != NULL && line != NULL; line = strtok_r(NULL, "\n", &lasts)) {
+      before[before_count++] = line;
+    }
+    octopass_members_diff(before, before_count, after, after_count, added, removed);
+  }
+
+  int status = octopass_export_data(file, list.data != NULL ? list.data : "", list.len);
+
+  json_t *value;
+  json_array_foreach(removed, i, value)
+  {
+    octopass_purge_user(con, json_string_value(value));
+    octopass_journal_append(con, "removed", json_string_value(value));
+  }
+  json_array_foreach(added, i, value)
+  {
+    if (prefetch) {
+      con->refresh     = true;
+      char *index      = NULL;
+      const char *keys = octopass_render_keys(con, (char *)json_string_value(value), &index);
+      con->refresh     = false;
+      free((char *)keys);
+      free(index);
+    }
+    octopass_journal_append(con, "added", json_string_value(value));
+  }
+
+  // Shared users accept the keys of exactly the current members.
+  int changes = (int)(json_array_size(added) + json_array_size(removed));
+  if (changes > 0 && prefetch) {
+    int j;
+    for (j = 0; j < con->shared_users_count; j++) {
+      char *index      = NULL;
+      const char *keys = octopass_render_keys(con, con->shared_users[j], &index);
+      free((char *)keys);
+      free(index);
+    }
+  }
+
+  if (con->syslog && changes > 0) {
+    syslog(LOG_INFO, "members changed: %lu added, %lu removed", (unsigned long)json_array_size(added),
+           (unsigned long)json_array_size(removed));
+  }
+
+  json_decref(added);
+  json_decref(removed);
+  free(before);
+  free(previous);
+  free(list.data);
+  free(after);
+
+  return status == 0 ? changes : -1;
+}
+
+// Hash of what passwd and group answer with a snapshot: the config, the
+// members with their ids and the members of each group. The hashes of the
+// entries are summed, so that the order GitHub lists them in does not matter.
+uint64_t octopass_content_hash(struct snapshot *snap)
+{
+  uint64_t h = octopass_hash(snap->key != NULL ? snap->key : "", 0);
+  char line[MAXBUF * 2];
+
+  size_t i;
+  for (i = 0; i < json_array_size(snap->members); i++) {
+    json_t *member    = json_array_get(snap->members, i);
+    const char *login = json_string_value(json_object_get(member, "login"));
+    if (login != NULL) {
+      snprintf(line, sizeof(line), "%s\t%lld", login, (long long)json_integer_value(json_object_get(member, "id")));
+      h += octopass_hash(line, 0);
+    }
+  }
+
+  int t;
+  for (t = 0; t < snap->teams_count; t++) {
+    struct team *team = &snap->teams[t];
+    const char *login;
+    json_t *value;
+    json_object_foreach(team->logins, login, value)
+    {
+      snprintf(line, sizeof(line), "%s\t%ld\t%s", team->name, team->gid, login);
+      h += octopass_hash(line, 0);
+    }
+  }
+
+  return h;
+}
+
+// Content hash of the config at the previous refresh.
+void octopass_content_file(struct config *con, char *file, size_t len)
+{
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  snprintf(file, len, "%s/content-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)octopass_hash(key, 0));
+}
+
+// Drops a database of nscd, as `nscd -i` does: a request header of version 2,
+// INVALIDATE and the length of the name with its terminator, then the name.
+// nscd only accepts it from root.
+// OK: 0
+// NG: -1
+int octopass_nscd_invalidate(const char *path, const char *db)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  char req[sizeof(int32_t) * 3 + MAXBUF];
+  int32_t head[3] = { OCTOPASS_NSCD_VERSION, OCTOPASS_NSCD_INVALIDATE, (int32_t)strlen(db) + 1 };
+  memcpy(req, head, sizeof(head));
+  snprintf(req + sizeof(head), sizeof(req) - sizeof(head), "%s", db);
+  size_t len = sizeof(head) + head[2];
+
+  int32_t res = -1;
+  int status  = -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && write(fd, req, len) == (ssize_t)len &&
+      read(fd, &res, sizeof(res)) == sizeof(res) && res == 0) {
+    status = 0;
+  }
+  close(fd);
+
+  return status;
+}
+
+// Records the content hash of the snapshot and, only when it differs from the
+// previous refresh, tells nscd to drop passwd and group, so that nscd can keep
+// a long ttl and still answer changed members promptly.
+// Returns 1 when the content changed, 0 when not, or -1 when it cannot be recorded.
+int octopass_content_apply(struct config *con, struct snapshot *snap, const char *nscd_socket)
+{
+  char file[MAXBUF];
+  octopass_content_file(con, file, sizeof(file));
+
+  char data[32];
+  snprintf(data, sizeof(data), "%016llx\n", (unsigned long long)octopass_content_hash(snap));
+  char *previous = access(file, R_OK) == 0 ? (char *)octopass_import_file(file) : NULL;
+  bool changed   = previous == NULL || strcmp(previous, data) != 0;
+  free(previous);
+  if (!changed) {
+    return 0;
+  }
+  if (octopass_export_data(file, data, strlen(data)) != 0) {
+    return -1;
+  }
+
+  if (nscd_socket != NULL && access(nscd_socket, F_OK) == 0) {
+    const char *dbs[] = { "passwd", "group" };
+    int i;
+    for (i = 0; i < 2; i++) {
+      if (octopass_nscd_invalidate(nscd_socket, dbs[i]) != 0 && con->syslog) {
+        syslog(LOG_INFO, "nscd not invalidated: %s", dbs[i]);
+      }
+    }
+  }
+  if (con->syslog) {
+    syslog(LOG_INFO, "content changed: %.16s", data);
+  }
+
+  return 1;
+}
+
+// Where the audit log position of the config is kept: the timestamp in
+// milliseconds applied up to, and when all members were last fetched.
+void octopass_cursor_file(struct config *con, char *file, size_t len)
+{
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  snprintf(file, len, "%s/cursor-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)octopass_hash(key, 0));
+}
+
+// OK: 0
+// NG: -1
+int octopass_cursor_load(struct config *con, long long *cursor, long *resynced_at)
+{
+  char file[MAXBUF];
+  octopass_cursor_file(con, file, sizeof(file));
+
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  int matched = fscanf(fp, "%lld %ld", cursor, resynced_at);
+  fclose(fp);
+
+  return matched == 2 ? 0 : -1;
+}
+
+// OK: 0
+// NG: -1
+int octopass_cursor_store(struct config *con, long long cursor, long resynced_at)
+{
+  char file[MAXBUF];
+  octopass_cursor_file(con, file, sizeof(file));
+
+  char data[64];
+  snprintf(data, sizeof(data), "%lld %ld\n", cursor, resynced_at);
+
+  return octopass_export_data(file, data, strlen(data));
+}
+
+// Returns the member with the login and id, as in the members list, or NULL.
+json_t *octopass_github_user(struct config *con, const char *login)
+{
+  char url[strlen(con->endpoint) + strlen(login) + 16];
+  sprintf(url, "%susers/%s", con->endpoint, login);
+
+  struct response res = { 0 };
+  octopass_github_request_without_cache(con, url, &res, NULL);
+  if (res.data == NULL || (long)res.httpstatus != 200) {
+    free(res.data);
+    return NULL;
+  }
+
+  json_error_t error;
+  json_t *user = json_loads(res.data, 0, &error);
+  free(res.data);
+
+  json_t *j_login = json_object_get(user, "login");
+  json_t *j_id    = json_object_get(user, "id");
+  if (!json_is_string(j_login) || !json_is_integer(j_id)) {
+    json_decref(user);
+    return NULL;
+  }
+
+  json_t *member = json_object();
+  json_object_set(member, "login", j_login);
+  json_object_set(member, "id", j_id);
+  json_decref(user);
+
+  return member;
+}
+
+static long octopass_member_index(json_t *members, const char *login)
+{
+  size_t i;
+  for (i = 0; i < json_array_size(members); i++) {
+    const char *l = json_string_value(json_object_get(json_array_get(members, i), "login"));
+    if (l != NULL && strcasecmp(l, login) == 0) {
+      return (long)i;
+    }
+  }
+  return -1;
+}
+
+// Applies team.add_member, team.remove_member and org.remove_member entries
+// at or after the cursor to the cached teams. The timestamp of the last
+// entry is stored in last.
+// Returns the number of changes, or -1 when a member cannot be fetched.
+int octopass_audit_log_apply(struct config *con, json_t *entries, long long cursor, struct cached_team *teams,
+                             int count, long long *last)
+{
+  int changes = 0;
+  size_t i;
+
+  for (i = 0; i < json_array_size(entries); i++) {
+    json_t *entry      = json_array_get(entries, i);
+    json_t *j_ts       = json_object_get(entry, "@timestamp");
+    const char *action = json_string_value(json_object_get(entry, "action"));
+    const char *login  = json_string_value(json_object_get(entry, "user"));
+    const char *team   = json_string_value(json_object_get(entry, "team"));
+    if (!json_is_integer(j_ts) || json_integer_value(j_ts) < cursor) {
+      continue;
+    }
+    *last = json_integer_value(j_ts);
+    if (action == NULL || login == NULL) {
+      continue;
+    }
+
+    bool add = strcmp(action, "team.add_member") == 0;
+    bool org = strcmp(action, "org.remove_member") == 0;
+    if (!add && !org && strcmp(action, "team.remove_member") != 0) {
+      continue;
+    }
+
+    int t;
+    for (t = 0; t < count; t++) {
+      if (!org && (team == NULL || strcasecmp(team, teams[t].slug) != 0)) {
+        continue;
+      }
+
+      long idx = octopass_member_index(teams[t].members, login);
+      if (add && idx == -1) {
+        json_t *member = NULL;
+        json_t *j_id   = json_object_get(entry, "user_id");
+        if (json_is_integer(j_id)) {
+          member = json_object();
+          json_object_set_new(member, "login", json_string(login));
+          json_object_set(member, "id", j_id);
+        } else {
+          member = octopass_github_user(con, login);
+        }
+        if (member == NULL) {
+          return -1;
+        }
+        json_array_append_new(teams[t].members, member);
+      } else if (!add && idx != -1) {
+        json_array_remove(teams[t].members, idx);
+      } else {
+        continue;
+      }
+      changes++;
+    }
+  }
+
+  return changes;
+}
+
+// Reads the cached members of Team and of each of Teams.
+// OK: 0
+// NG: -1
+static int octopass_cached_teams_load(struct config *con, struct cached_team *teams, int count)
+{
+  char url[strlen(con->endpoint) + strlen(con->organization) + 64];
+  sprintf(url, "%sorgs/%s/teams?per_page=100", con->endpoint, con->organization);
+
+  struct response res = { 0 };
+  octopass_github_request(con, url, &res);
+  if (res.data == NULL) {
+    return -1;
+  }
+
+  json_error_t error;
+  json_t *list = json_loads(res.data, 0, &error);
+  free(res.data);
+
+  int t;
+  for (t = 0; t < count; t++) {
+    teams[t].name = t == 0 ? con->team : con->teams[t - 1];
+
+    json_t *j_team = NULL;
+    size_t i;
+    for (i = 0; i < json_array_size(list); i++) {
+      const char *name = json_string_value(json_object_get(json_array_get(list, i), "name"));
+      if (name != NULL && strcmp(name, teams[t].name) == 0) {
+        j_team = json_array_get(list, i);
+        break;
+      }
+    }
+    const char *slug = json_string_value(json_object_get(j_team, "slug"));
+    json_t *j_id     = json_object_get(j_team, "id");
+    if (slug == NULL || !json_is_integer(j_id)) {
+      json_decref(list);
+      return -1;
+    }
+    snprintf(teams[t].slug, sizeof(teams[t].slug), "%s/%s", con->organization, slug);
+
+    char members_url[strlen(con->endpoint) + 64];
+    sprintf(members_url, "%steams/%ld/members?per_page=100", con->endpoint, (long)json_integer_value(j_id));
+    octopass_cache_key(con, members_url, teams[t].key, sizeof(teams[t].key));
+
+    char *data       = con->backend->get(con, teams[t].key);
+    teams[t].members = data != NULL ? json_loads(data, 0, &error) : NULL;
+    free(data);
+    if (!json_is_array(teams[t].members)) {
+      json_decref(list);
+      return -1;
+    }
+  }
+  json_decref(list);
+
+  return 0;
+}
+
+// Pages through the audit log since the cursor, applying it to the teams.
+// OK: 0
+// NG: -1
+// A full refresh is due: 1
+static int octopass_audit_log_fetch(struct config *con, long long cursor, struct cached_team *teams, int count,
+                                    long long *last, int *changes)
+{
+  *last    = cursor;
+  *changes = 0;
+
+  while (1) {
+    char created[64];
+    struct tm tm;
+    time_t sec = *last / 1000;
+    strftime(created, sizeof(created), "created:>=%Y-%m-%dT%H:%M:%SZ", gmtime_r(&sec, &tm));
+    char *phrase = curl_escape(created, strlen(created));
+    char url[strlen(con->endpoint) + strlen(con->organization) + strlen(phrase) + 64];
+    sprintf(url, "%sorgs/%s/audit-log?phrase=%s&order=asc&per_page=%d", con->endpoint, con->organization, phrase,
+            OCTOPASS_AUDIT_LOG_PAGE);
+    curl_free(phrase);
+
+    struct response res = { 0 };
+    octopass_github_request_without_cache(con, url, &res, NULL);
+    if (res.data == NULL || (long)res.httpstatus != 200) {
+      free(res.data);
+      return -1;
+    }
+    json_error_t error;
+    json_t *entries = json_loads(res.data, 0, &error);
+    free(res.data);
+    if (!json_is_array(entries)) {
+      json_decref(entries);
+      return -1;
+    }
+
+    long long from = *last;
+    int n          = octopass_audit_log_apply(con, entries, cursor, teams, count, last);
+    size_t size    = json_array_size(entries);
+    json_decref(entries);
+    if (n == -1) {
+      return -1;
+    }
+    *changes += n;
+
+    if (size < OCTOPASS_AUDIT_LOG_PAGE) {
+      return 0;
+    }
+    // A page within one second cannot be paged with created, fetch everything instead.
+    if (*last / 1000 == from / 1000) {
+      return 1;
+    }
+  }
+}
+
+// Writes the teams back to the cache, which also keeps them fresh.
+// OK: 0
+// NG: -1
+static int octopass_cached_teams_store(struct config *con, struct cached_team *teams, int count)
+{
+  int t;
+  for (t = 0; t < count; t++) {
+    char *data = json_dumps(teams[t].members, JSON_COMPACT);
+    if (data == NULL || con->backend->put(con, teams[t].key, data, con->cache + OCTOPASS_CACHE_RETENTION) != 0) {
+      free(data);
+      return -1;
+    }
+    free(data);
+  }
+  return 0;
+}
+
+// Applies the team membership changes of the organization audit log since
+// the cursor to the cached members, so that the cost of a refresh follows the
+// churn instead of the size of the organization. Only the keys of changed
+// logins are fetched, the others are fetched again when their rendered keys expire.
+// OK: 0
+// NG: -1
+// A full refresh is due: 1
+int octopass_refresh_incremental(struct config *con)
+{
+  long long cursor;
+  long resynced_at;
+  if (strlen(con->repository) != 0 || con->cache == 0 || octopass_cursor_load(con, &cursor, &resynced_at) != 0 ||
+      time(NULL) - resynced_at > con->resync) {
+    return 1;
+  }
+
+  int count                 = con->teams_count + 1;
+  struct cached_team *teams = calloc(count, sizeof(struct cached_team));
+  if (teams == NULL) {
+    return -1;
+  }
+
+  long long last = cursor;
+  int changes    = 0;
+  int status     = octopass_cached_teams_load(con, teams, count) == 0 ? 0 : 1;
+  if (status == 0) {
+    status = octopass_audit_log_fetch(con, cursor, teams, count, &last, &changes);
+  }
+  if (status == 0) {
+    status = octopass_cached_teams_store(con, teams, count);
+  }
+
+  int t;
+  for (t = 0; t < count; t++) {
+    json_decref(teams[t].members);
+  }
+  free(teams);
+
+  struct snapshot *snap = NULL;
+  if (status == 0) {
+    octopass_cursor_store(con, last, resynced_at);
+    snap   = octopass_snapshot_load(con);
+    status = snap == NULL ? -1 : 0;
+  }
+  if (snap != NULL) {
+    octopass_snapshot_publish(snap);
+    if (changes > 0) {
+      octopass_generation_bump(con);
+    }
+    octopass_members_diff_apply(con, snap, true);
+    octopass_content_apply(con, snap, OCTOPASS_NSCD_SOCKET);
+    if (con->syslog) {
+      syslog(LOG_INFO, "refreshed incrementally: %d changes", changes);
+    }
+    octopass_snapshot_unref(snap);
+  }
+
+  return status;
+}
+
+// Fetches everything lookups read ahead of expiry: members, teams, the
+// presence filter and the rendered keys of every member and shared user.
+// OK: 0
+// NG: -1
+int octopass_refresh(struct config *con)
+{
+  if (con->incremental) {
+    int status = octopass_refresh_incremental(con);
+    if (status == 0) {
+      return 0;
+    }
+    if (status == -1 && con->syslog) {
+      syslog(LOG_INFO, "incremental refresh failure, fetching all members");
+    }
+  }
+  // Changes made while fetching are applied again by the next incremental refresh.
+  long long started = (long long)time(NULL) * 1000;
+
+  con->refresh          = true;
+  struct snapshot *snap = octopass_snapshot_load(con);
+  if (snap == NULL) {
+    con->refresh = false;
+    return -1;
+  }
+  octopass_snapshot_publish(snap);
+  // Every member is rendered below, removed ones are purged here.
+  octopass_members_diff_apply(con, snap, false);
+  octopass_content_apply(con, snap, OCTOPASS_NSCD_SOCKET);
+
+  size_t i;
+  for (i = 0; i < json_array_size(snap->members); i++) {
+    const char *login = json_string_value(json_object_get(json_array_get(snap->members, i), "login"));
+    if (login == NULL) {
+      continue;
+    }
+    char *index      = NULL;
+    const char *keys = octopass_render_keys(con, (char *)login, &index);
+    free((char *)keys);
+    free(index);
+  }
+
+  // Shared users are made of the member keys just fetched.
+  con->refresh = false;
+  int j;
+  for (j = 0; j < con->shared_users_count; j++) {
+    char *index      = NULL;
+    const char *keys = octopass_render_keys(con, con->shared_users[j], &index);
+    free((char *)keys);
+    free(index);
+  }
+
+  if (con->incremental) {
+    octopass_cursor_store(con, started, started / 1000);
+  }
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "refreshed: %lu members", (unsigned long)json_array_size(snap->members));
+  }
+  octopass_snapshot_unref(snap);
+
+  return 0;
+}
+
+// A delay within the first quarter of the cache period that is stable for a
+// host and differs between hosts, so that a fleet does not refresh at once.
+long octopass_refresh_jitter(struct config *con)
+{
+  char host[256] = { 0 };
+  gethostname(host, sizeof(host) - 1);
+
+  return (long)(octopass_hash(host, 0) % (unsigned long)(con->cache / 4 + 1));
+}
+
+static int octopass_write_all(int fd, const char *p, size_t n)
+{
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+
+  return 0;
+}
+
+// Reads a whole file that may hold binary data.
+// Returns NULL when it cannot be read or is larger than a bundle.
+char *octopass_read_data(char *file, size_t *len)
+{
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    return NULL;
+  }
+
+  struct buffer data = { 0 };
+  char chunk[8192];
+  size_t n;
+  int status = octopass_buffer_append(&data, "", 0);
+  while (status == 0 && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    status = data.len + n > OCTOPASS_BUNDLE_MAX_SIZE ? -1 : octopass_buffer_append(&data, chunk, n);
+  }
+  if (status != 0 || ferror(fp)) {
+    free(data.data);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+
+  *len = data.len;
+  return data.data;
+}
+
+// The file stores keep one file per key under the directory of the backend,
+// dated when it was put. A directory in a world writable place is only made
+// by root and only used when owned by root and writable by root only. One
+// left there by anybody else is moved aside when root makes it.
+// OK: 0
+// NG: -1
+static int octopass_file_cache_dir(struct config *con, bool create)
+{
+  const struct cache_backend *b = con->backend;
+  bool may_create               = create && (!b->shared_parent || geteuid() == 0);
+  struct stat st;
+  int exists = lstat(b->dir, &st) == 0;
+  if (exists && b->shared_parent && may_create &&
+      (!S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)) {
+    char aside[MAXBUF];
+    snprintf(aside, sizeof(aside), "%s.untrusted-%ld-%d", b->dir, (long)time(NULL), (int)getpid());
+    if (rename(b->dir, aside) == 0) {
+      exists = 0;
+      errno  = ENOENT;
+      if (con->syslog) {
+        syslog(LOG_INFO, "untrusted cache directory moved aside: %s", aside);
+      }
+    }
+  }
+  if (!exists) {
+    if (errno != ENOENT || !may_create || mkdir(b->dir, 0755) != 0 || lstat(b->dir, &st) != 0) {
+      return -1;
+    }
+  }
+  if (b->shared_parent && (!S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)) {
+    fprintf(stderr, "Untrusted cache directory: %s\n", b->dir);
+    return -1;
+  }
+  return 0;
+}
+
+// Keys are hashed into two levels of shards, <dir>/ab/cd/<hash>-<token6>, so
+// that no directory grows with the number of users. The token part of the key
+// is kept in the name, for bundles.
+static void octopass_file_cache_path(struct config *con, const char *key, const char *suffix, char *file, size_t len)
+{
+  unsigned char digest[32];
+  EVP_Digest(key, strlen(key), digest, NULL, EVP_sha256(), NULL);
+  char hash[33];
+  int i;
+  for (i = 0; i < 16; i++) {
+    sprintf(hash + i * 2, "%02x", digest[i]);
+  }
+  const char *token = strrchr(key, '-');
+  snprintf(file, len, "%s/%.2s/%.2s/%s%s%s", con->backend->dir, hash, hash + 2, hash, token != NULL ? token : "",
+           suffix);
+}
+
+// Whether a name is one of the two hex digits of a shard.
+static bool octopass_is_shard(const char *name)
+{
+  return isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]) && (name[2] == '\0' || name[2] == '/');
+}
+
+// Makes the shard directories of a file.
+// OK: 0
+// NG: -1
+static int octopass_file_cache_shard(const char *file)
+{
+  char dir[strlen(file) + 1];
+  strcpy(dir, file);
+  char *slash = strrchr(dir, '/');
+  *slash      = '\0';
+  if (mkdir(dir, 0755) == 0 || errno == EEXIST) {
+    return 0;
+  }
+
+  char *parent = strrchr(dir, '/');
+  *parent      = '\0';
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  *parent = '/';
+  return mkdir(dir, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// Reading a response marks it used for the garbage collection, even where
+// the file system does not update atime by itself.
+static char *octopass_file_cache_get(struct config *con, const char *key)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, "", file, sizeof(file));
+  if (octopass_file_cache_dir(con, false) != 0) {
+    return NULL;
+  }
+  size_t len;
+  char *data = octopass_read_data(file, &len);
+  if (data != NULL) {
+    struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+    utimensat(AT_FDCWD, file, times, 0);
+  }
+  // Compressed or not, whatever CacheCompress was when it was put.
+  if (data != NULL && octopass_is_compressed(OCTOPASS_CACHE_MAGIC, data, len)) {
+    char *raw = octopass_uncompress(OCTOPASS_CACHE_MAGIC, data, len, OCTOPASS_MAX_BUFFER_SIZE, &len);
+    free(data);
+    data = raw;
+  }
+  return data;
+}
+
+// Files are kept until they are replaced or collected, regardless of ttl.
+static int octopass_file_cache_put(struct config *con, const char *key, const char *data, long ttl)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, "", file, sizeof(file));
+
+  size_t len           = strlen(data);
+  unsigned char *zdata = NULL;
+  if (con->cache_compress) {
+    zdata = octopass_compress(OCTOPASS_CACHE_MAGIC, data, len, OCTOPASS_CACHE_COMPRESS_LEVEL, &len);
+    if (zdata == NULL) {
+      return -1;
+    }
+  }
+
+  int status = 0;
+  if (octopass_file_cache_dir(con, true) != 0 || octopass_file_cache_shard(file) != 0 ||
+      octopass_export_data(file, zdata != NULL ? (const void *)zdata : data, len) != 0) {
+    fprintf(stderr, "File open failure: %s\n", file);
+    status = -1;
+  }
+  free(zdata);
+  return status;
+}
+
+static long octopass_file_cache_age(struct config *con, const char *key)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, "", file, sizeof(file));
+  struct stat st;
+  if (octopass_file_cache_dir(con, false) != 0 || stat(file, &st) != 0) {
+    return -1;
+  }
+  long age = time(NULL) - st.st_mtime;
+  return age < 0 ? 0 : age;
+}
+
+static int octopass_file_cache_remove(struct config *con, const char *key)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, "", file, sizeof(file));
+  return unlink(file) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+// A lock file left by a process that died is taken over once older than ttl.
+static int octopass_file_cache_lock(struct config *con, const char *key, long ttl)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, ".lock", file, sizeof(file));
+
+  int attempt;
+  for (attempt = 0; attempt < 2; attempt++) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd != -1) {
+      close(fd);
+      return 0;
+    }
+    struct stat st;
+    if (errno != EEXIST || stat(file, &st) != 0) {
+      return -1;
+    }
+    if (time(NULL) - st.st_mtime < ttl) {
+      return 1;
+    }
+    unlink(file);
+  }
+  return 1;
+}
+
+static void octopass_file_cache_unlock(struct config *con, const char *key)
+{
+  char file[MAXBUF];
+  octopass_file_cache_path(con, key, ".lock", file, sizeof(file));
+  unlink(file);
+}
+
+struct cache_entry {
+  char *file;
+  time_t atime;
+  off_t size;
+};
+
+static int octopass_cache_entry_cmp(const void *a, const void *b)
+{
+  time_t x = ((const struct cache_entry *)a)->atime;
+  time_t y = ((const struct cache_entry *)b)->atime;
+  return x < y ? -1 : x > y;
+}
+
+// Collects the files of one shard directory, skipping locks and temporary files.
+// OK: 0
+// NG: -1
+static int octopass_file_cache_scan(const char *dir, struct cache_entry **entries, size_t *count, size_t *cap)
+{
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return 0;
+  }
+
+  int status = 0;
+  struct dirent *ent;
+  while (status == 0 && (ent = readdir(d)) != NULL) {
+    char file[MAXBUF];
+    struct stat st;
+    snprintf(file, sizeof(file), "%s/%s", dir, ent->d_name);
+    if (strchr(ent->d_name, '.') != NULL || lstat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (*count == *cap) {
+      size_t next             = *cap > 0 ? *cap * 2 : 256;
+      struct cache_entry *grown = realloc(*entries, next * sizeof(struct cache_entry));
+      if (grown == NULL) {
+        status = -1;
+        break;
+      }
+      *entries = grown;
+      *cap     = next;
+    }
+    (*entries)[*count].file  = strdup(file);
+    (*entries)[*count].atime = st.st_atime;
+    (*entries)[*count].size  = st.st_size;
+    status                   = (*entries)[*count].file != NULL ? 0 : -1;
+    (*count)++;
+  }
+  closedir(d);
+
+  return status;
+}
+
+// Evicts the least recently used responses while the store holds more than
+// CacheMaxEntries of them or more than CacheMaxSize bytes. Responses left in
+// the flat layout of older versions are removed on the way.
+// Returns the number of files removed, or -1.
+static int octopass_file_cache_gc(struct config *con)
+{
+  const char *top = con->backend->dir;
+  if (octopass_file_cache_dir(con, false) != 0) {
+    return -1;
+  }
+  DIR *d = opendir(top);
+  if (d == NULL) {
+    return -1;
+  }
+
+  struct cache_entry *entries = NULL;
+  size_t count                = 0;
+  size_t cap                  = 0;
+  int removed                 = 0;
+  int status                  = 0;
+  struct dirent *ent;
+  while (status == 0 && (ent = readdir(d)) != NULL) {
+    char path[MAXBUF];
+    snprintf(path, sizeof(path), "%s/%s", top, ent->d_name);
+    if (strncmp(ent->d_name, "http", strlen("http")) == 0) {
+      removed += unlink(path) == 0;
+      continue;
+    }
+    if (strlen(ent->d_name) != 2 || !octopass_is_shard(ent->d_name)) {
+      continue;
+    }
+
+    DIR *shard = opendir(path);
+    if (shard == NULL) {
+      continue;
+    }
+    struct dirent *sub;
+    while (status == 0 && (sub = readdir(shard)) != NULL) {
+      if (strlen(sub->d_name) == 2 && octopass_is_shard(sub->d_name)) {
+        char dir[MAXBUF * 2];
+        snprintf(dir, sizeof(dir), "%s/%s", path, sub->d_name);
+        status = octopass_file_cache_scan(dir, &entries, &count, &cap);
+      }
+    }
+    closedir(shard);
+  }
+  closedir(d);
+
+  unsigned long long bytes = 0;
+  size_t i;
+  for (i = 0; i < count; i++) {
+    bytes += entries[i].size;
+  }
+
+  size_t left = count;
+  if (status == 0 && (left > (size_t)con->cache_max_entries || bytes > (unsigned long long)con->cache_max_size)) {
+    qsort(entries, count, sizeof(struct cache_entry), octopass_cache_entry_cmp);
+    for (i = 0; i < count && (left > (size_t)con->cache_max_entries || bytes > (unsigned long long)con->cache_max_size);
+         i++) {
+      if (unlink(entries[i].file) == 0) {
+        removed++;
+      }
+      bytes -= entries[i].size;
+      left--;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    free(entries[i].file);
+  }
+  free(entries);
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "cache gc: %d removed, %lu left", removed, (unsigned long)left);
+  }
+  return status == 0 ? removed : -1;
+}
+
+// Sends one command on fd and reads its reply to out: the line of a simple string,
+// error or integer, or the bulk string, with out->data NULL for nil.
+// Returns the type of the reply ('+', '-', ':' or '$'), or -1.
+static int octopass_resp_exchange(int fd, int argc, const char **argv, const size_t *lens, struct buffer *out)
+{
+  struct buffer req = { 0 };
+  char head[64];
+  int n      = snprintf(head, sizeof(head), "*%d\r\n", argc);
+  int status = octopass_buffer_append(&req, head, n);
+  int i;
+  for (i = 0; i < argc && status == 0; i++) {
+    n      = snprintf(head, sizeof(head), "$%lu\r\n", (unsigned long)lens[i]);
+    status = octopass_buffer_append(&req, head, n) || octopass_buffer_append(&req, argv[i], lens[i]) ||
+             octopass_buffer_append(&req, "\r\n", 2);
+  }
+  if (status == 0) {
+    status = octopass_write_all(fd, req.data, req.len);
+  }
+  free(req.data);
+
+  // Complete with its first line, and for a bulk string with as many bytes and CRLF after it.
+  struct buffer reply = { 0 };
+  char chunk[8192];
+  int type = -1;
+  while (status == 0) {
+    char *eol = reply.len > 0 ? strstr(reply.data, "\r\n") : NULL;
+    if (eol != NULL && eol > reply.data) {
+      size_t line = eol - reply.data;
+      long size   = reply.data[0] == '$' ? strtol(reply.data + 1, NULL, 10) : 0;
+      if (reply.data[0] != '$') {
+        type   = reply.data[0];
+        status = octopass_buffer_append(out, reply.data + 1, line - 1);
+        break;
+      }
+      if (size < 0) {
+        type = '$';
+        break;
+      }
+      if (size > OCTOPASS_MAX_BUFFER_SIZE) {
+        break;
+      }
+      if (reply.len >= line + 2 + size + 2) {
+        type   = '$';
+        status = octopass_buffer_append(out, reply.data + line + 2, size);
+        break;
+      }
+    }
+
+    ssize_t r = read(fd, chunk, sizeof(chunk));
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0 || octopass_buffer_append(&reply, chunk, r) != 0) {
+      break;
+    }
+  }
+  free(reply.data);
+
+  return status == 0 ? type : -1;
+}
+
+// Connects to CacheServer, "host:port", authenticated with CachePassword when set.
+// Returns the socket, or -1.
+static int octopass_resp_connect(struct config *con)
+{
+  char host[MAXBUF];
+  snprintf(host, sizeof(host), "%s", con->cache_server);
+  char *port = strrchr(host, ':');
+  if (port == NULL) {
+    return -1;
+  }
+  *port++ = '\0';
+
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    return -1;
+  }
+  int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd != -1) {
+    struct timeval timeout = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+  if (fd == -1 || connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    fprintf(stderr, "Cache server unreachable: %s\n", con->cache_server);
+    if (fd != -1) {
+      close(fd);
+    }
+    freeaddrinfo(ai);
+    return -1;
+  }
+  freeaddrinfo(ai);
+
+  if (strlen(con->cache_password) > 0) {
+    const char *argv[] = { "AUTH", con->cache_password };
+    size_t lens[]      = { 4, strlen(con->cache_password) };
+    struct buffer out  = { 0 };
+    int type           = octopass_resp_exchange(fd, 2, argv, lens, &out);
+    if (type != '+') {
+      fprintf(stderr, "Cache server refused AUTH: %s\n", out.data != NULL ? out.data : con->cache_server);
+      if (con->syslog) {
+        syslog(LOG_ERR, "cache server refused AUTH: %s", con->cache_server);
+      }
+      close(fd);
+      fd = -1;
+    }
+    free(out.data);
+  }
+
+  return fd;
+}
+
+// Takes the idle connection when it was made by this process to the same server,
+// otherwise connects. reused tells which, a reused one may have been closed by the server.
+static int octopass_resp_acquire(struct config *con, bool *reused)
+{
+  pthread_mutex_lock(&OCTOPASS_RESP_MUTEX);
+  int fd         = octopass_resp_fd;
+  octopass_resp_fd = -1;
+  if (fd != -1 && (octopass_resp_pid != getpid() || strcmp(octopass_resp_server, con->cache_server) != 0 ||
+                   strcmp(octopass_resp_password, con->cache_password) != 0)) {
+    // Inherited over a fork, the parent may be using it too, or for another server.
+    close(fd);
+    fd = -1;
+  }
+  pthread_mutex_unlock(&OCTOPASS_RESP_MUTEX);
+
+  *reused = fd != -1;
+  return fd != -1 ? fd : octopass_resp_connect(con);
+}
+
+// Keeps a connection which answered completely as the idle one, closes the others.
+static void octopass_resp_release(struct config *con, int fd)
+{
+  pthread_mutex_lock(&OCTOPASS_RESP_MUTEX);
+  if (octopass_resp_fd == -1) {
+    octopass_resp_fd  = fd;
+    octopass_resp_pid = getpid();
+    snprintf(octopass_resp_server, sizeof(octopass_resp_server), "%s", con->cache_server);
+    snprintf(octopass_resp_password, sizeof(octopass_resp_password), "%s", con->cache_password);
+    fd = -1;
+  }
+  pthread_mutex_unlock(&OCTOPASS_RESP_MUTEX);
+
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+// Sends one command to the RESP (redis protocol) server of CacheServer on the
+// idle connection if any, once more on a new one when that has gone away.
+// Returns the type of the reply ('+', '-', ':' or '$'), or -1.
+static int octopass_resp_command(struct config *con, int argc, const char **argv, const size_t *lens,
+                                 struct buffer *out)
+{
+  bool reused;
+  int fd = octopass_resp_acquire(con, &reused);
+  if (fd == -1) {
+    return -1;
+  }
+  int type = octopass_resp_exchange(fd, argc, argv, lens, out);
+  if (type == -1 && reused && out->len == 0) {
+    close(fd);
+    if ((fd = octopass_resp_connect(con)) == -1) {
+      return -1;
+    }
+    type = octopass_resp_exchange(fd, argc, argv, lens, out);
+  }
+
+  if (type == -1) {
+    close(fd);
+  } else {
+    octopass_resp_release(con, fd);
+  }
+  return type;
+}
+
+static int octopass_redis(struct config *con, const char *command, const char *key, const char *suffix,
+                          const char **args, int args_count, struct buffer *out)
+{
+  char rkey[strlen(OCTOPASS_REDIS_PREFIX) + strlen(key) + strlen(suffix) + 1];
+  sprintf(rkey, "%s%s%s", OCTOPASS_REDIS_PREFIX, key, suffix);
+
+  const char *argv[args_count + 2];
+  size_t lens[args_count + 2];
+  argv[0] = command;
+  argv[1] = rkey;
+  int i;
+  for (i = 0; i < args_count; i++) {
+    argv[i + 2] = args[i];
+  }
+  for (i = 0; i < args_count + 2; i++) {
+    lens[i] = strlen(argv[i]);
+  }
+
+  return octopass_resp_command(con, args_count + 2, argv, lens, out);
+}
+
+// Values are "<unix time put>\n<data>".
+static char *octopass_redis_cache_get(struct config *con, const char *key)
+{
+  struct buffer out = { 0 };
+  char *data        = NULL;
+  if (octopass_redis(con, "GET", key, "", NULL, 0, &out) == '$' && out.data != NULL &&
+      (data = memchr(out.data, '\n', out.len)) != NULL) {
+    memmove(out.data, data + 1, out.len - (data + 1 - out.data) + 1);
+    return out.data;
+  }
+  free(out.data);
+  return NULL;
+}
+
+static int octopass_redis_cache_put(struct config *con, const char *key, const char *data, long ttl)
+{
+  char *value = malloc(strlen(data) + 32);
+  if (value == NULL) {
+    return -1;
+  }
+  sprintf(value, "%ld\n%s", (long)time(NULL), data);
+  char expire[32];
+  snprintf(expire, sizeof(expire), "%ld", ttl > 0 ? ttl : 1);
+
+  const char *args[] = { value, "EX", expire };
+  struct buffer out  = { 0 };
+  int type           = octopass_redis(con, "SET", key, "", args, 3, &out);
+  free(value);
+  free(out.data);
+  return type == '+' ? 0 : -1;
+}
+
+static long octopass_redis_cache_age(struct config *con, const char *key)
+{
+  const char *args[] = { "0", "20" };
+  struct buffer out  = { 0 };
+  long age           = -1;
+  if (octopass_redis(con, "GETRANGE", key, "", args, 2, &out) == '$' && out.len > 0) {
+    age = time(NULL) - strtol(out.data, NULL, 10);
+    age = age < 0 ? 0 : age;
+  }
+  free(out.data);
+  return age;
+}
+
+static int octopass_redis_cache_remove(struct config *con, const char *key)
+{
+  struct buffer out = { 0 };
+  int type          = octopass_redis(con, "DEL", key, "", NULL, 0, &out);
+  free(out.data);
+  return type == ':' ? 0 : -1;
+}
+
+// Held for ttl at most, so that a host that died does not keep it.
+static int octopass_redis_cache_lock(struct config *con, const char *key, long ttl)
+{
+  char expire[32];
+  snprintf(expire, sizeof(expire), "%ld", ttl > 0 ? ttl : 1);
+  const char *args[] = { "1", "NX", "EX", expire };
+  struct buffer out  = { 0 };
+  int type           = octopass_redis(con, "SET", key, ".lock", args, 4, &out);
+  int status         = type == '+' ? 0 : type == '$' ? 1 : -1;
+  free(out.data);
+  return status;
+}
+
+static void octopass_redis_cache_unlock(struct config *con, const char *key)
+{
+  struct buffer out = { 0 };
+  octopass_redis(con, "DEL", key, ".lock", NULL, 0, &out);
+  free(out.data);
+}
+
+// Keys expire with their ttl.
+static int octopass_redis_cache_gc(struct config *con)
+{
+  return 0;
+}
+
+const struct cache_backend octopass_file_backend = {
+  "file",
+  OCTOPASS_CACHE_DIR,
+  false,
+  octopass_file_cache_get,
+  octopass_file_cache_put,
+  octopass_file_cache_age,
+  octopass_file_cache_remove,
+  octopass_file_cache_lock,
+  octopass_file_cache_unlock,
+  octopass_file_cache_gc,
+};
+
+const struct cache_backend octopass_shm_backend = {
+  "shm",
+  OCTOPASS_SHM_CACHE_DIR,
+  true,
+  octopass_file_cache_get,
+  octopass_file_cache_put,
+  octopass_file_cache_age,
+  octopass_file_cache_remove,
+  octopass_file_cache_lock,
+  octopass_file_cache_unlock,
+  octopass_file_cache_gc,
+};
+
+const struct cache_backend octopass_redis_backend = {
+  "redis",
+  NULL,
+  false,
+  octopass_redis_cache_get,
+  octopass_redis_cache_put,
+  octopass_redis_cache_age,
+  octopass_redis_cache_remove,
+  octopass_redis_cache_lock,
+  octopass_redis_cache_unlock,
+  octopass_redis_cache_gc,
+};
+
+// Returns NULL for an unknown name.
+const struct cache_backend *octopass_cache_backend(const char *name)
+{
+  const struct cache_backend *backends[] = { &octopass_file_backend, &octopass_shm_backend, &octopass_redis_backend };
+  size_t i;
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (strcmp(backends[i]->name, name) == 0) {
+      return backends[i];
+    }
+  }
+  return NULL;
 }
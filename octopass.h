@@ -17,22 +17,37 @@
 #ifndef OCTOPASS_H
 #define OCTOPASS_H
 
+#include <crypt.h>
+#include <ctype.h>
 #include <curl/curl.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <jansson.h>
+#include <netdb.h>
 #include <nss.h>
+#include <openssl/evp.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <shadow.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <regex.h>
+#include <zlib.h>
 
 #define OCTOPASS_VERSION "0.4.1"
 #define OCTOPASS_VERSION_WITH_NAME "octopass/" OCTOPASS_VERSION
@@ -49,10 +64,74 @@
     pthread_mutex_unlock(&OCTOPASS_MUTEX);                                                                             \
   } while (0);
 
+// Cache of the shm backend, on tmpfs
+#define OCTOPASS_SHM_CACHE_DIR "/dev/shm/octopass"
+// How long a response is kept after it went stale, for when GitHub cannot be reached
+#define OCTOPASS_CACHE_RETENTION (24 * 60 * 60)
+// How long one refresh of a cached response keeps others waiting
+#define OCTOPASS_CACHE_LOCK_TTL 15
+// Budget of the file stores, enforced at each refresh
+#define OCTOPASS_CACHE_MAX_ENTRIES 65536
+#define OCTOPASS_CACHE_MAX_SIZE (256 * 1024 * 1024)
+// Responses stored with CacheCompress start with this, as bundles do
+#define OCTOPASS_CACHE_MAGIC "octocmp1"
+#define OCTOPASS_CACHE_COMPRESS_LEVEL 6
+#define OCTOPASS_REDIS_PREFIX "octopass:"
+#define OCTOPASS_REDIS_SERVER "127.0.0.1:6379"
+
+// Verified tokens, readable by root only
+#define OCTOPASS_TOKEN_CACHE_DIR OCTOPASS_CACHE_DIR "/tokens"
+// How long a verified token keeps working while GitHub cannot be reached
+#define OCTOPASS_TOKEN_TTL (24 * 60 * 60)
+
+// Members added and removed at each refresh
+#define OCTOPASS_JOURNAL_FILE OCTOPASS_CACHE_DIR "/journal"
+#define OCTOPASS_JOURNAL_MAX_SIZE (1024 * 1024)
+
+// nscd answers from its cache until its ttl expires unless invalidated, see octopass_content_apply
+#define OCTOPASS_NSCD_SOCKET "/var/run/nscd/socket"
+#define OCTOPASS_NSCD_VERSION 2
+#define OCTOPASS_NSCD_INVALIDATE 10
+
+// A bundle is the cache of a config, compressed, for hosts that do not call GitHub
+#define OCTOPASS_BUNDLE_MAGIC "octobnd1"
+#define OCTOPASS_BUNDLE_VERSION 2
+#define OCTOPASS_BUNDLE_MAX_SIZE (256 * 1024 * 1024)
+// "ed25519=", an Ed25519 signature in base64 without padding and the terminator
+#define OCTOPASS_BUNDLE_SIGNATURE_LEN (8 + 86 + 1)
+
+// How often an incremental refresh fetches all members anyway
+#define OCTOPASS_RESYNC (24 * 60 * 60)
+// Entries of one page of the audit log
+#define OCTOPASS_AUDIT_LOG_PAGE 100
+
 // 10MB
 #define OCTOPASS_MAX_BUFFER_SIZE (10 * 1024 * 1024)
 
+// Webhook payloads are small, anything larger is not from GitHub
+#define OCTOPASS_WEBHOOK_MAX_PAYLOAD (1024 * 1024)
+#define OCTOPASS_WEBHOOK_PORT 9981
+
+// Responses of GitHub kept by a proxy for other hosts, per path and token
+#define OCTOPASS_PROXY_PORT 9982
+#define OCTOPASS_PROXY_LISTEN "127.0.0.1"
+#define OCTOPASS_PROXY_WORKERS 64
+#define OCTOPASS_PROXY_BUCKETS 1024
+#define OCTOPASS_PROXY_MAX_ENTRIES 65536
+
+// Varlink service of systemd-userdbd, see octopass_userdb_receive
+#define OCTOPASS_USERDB_SERVICE "io.systemd.Octopass"
+#define OCTOPASS_USERDB_SOCKET "/run/systemd/userdb/" OCTOPASS_USERDB_SERVICE
+#define OCTOPASS_USERDB_MAX_MESSAGE (64 * 1024)
+#define OCTOPASS_USERDB_WORKERS 32
+
+// "SHA256:" and a sha256 digest in base64 without padding
+#define OCTOPASS_FINGERPRINT_LEN 64
+
 #define MAXBUF 1024
+// SharedUsers and Teams are kept in the config itself, nothing to free.
+#define OCTOPASS_MAX_NAMES 32
+#define OCTOPASS_MAX_NAME 128
 #define DELIM "= "
 
 // This macro is available with more than 2.5
@@ -61,12 +140,41 @@
   for (index = 0; index < json_array_size(array) && (value = json_array_get(array, index)); index++)
 #endif
 
+// Text that keeps its length and grows geometrically, so that appending is
+// linear in the output. data is always terminated.
+struct buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
 struct response {
   char *data;
   size_t size;
   long *httpstatus;
 };
 
+struct config;
+
+// Store of the responses of GitHub, chosen with CacheBackend. Keys are names of files of the file store.
+struct cache_backend {
+  const char *name;
+  const char *dir; // of the file stores
+  bool shared_parent; // dir is in a world writable place
+  // Returns the data of a key, NULL when it is not cached.
+  char *(*get)(struct config *con, const char *key);
+  // Keeps data for ttl seconds at least. OK: 0, NG: -1
+  int (*put)(struct config *con, const char *key, const char *data, long ttl);
+  // Seconds since the key was put, -1 when it is not cached.
+  long (*age)(struct config *con, const char *key);
+  int (*remove)(struct config *con, const char *key);
+  // Takes the lock of a key for ttl seconds. OK: 0, held by another: 1, NG: -1
+  int (*lock)(struct config *con, const char *key, long ttl);
+  void (*unlock)(struct config *con, const char *key);
+  // Evicts entries beyond CacheMaxEntries and CacheMaxSize. Returns the number evicted, or -1.
+  int (*gc)(struct config *con);
+};
+
 struct config {
   char endpoint[MAXBUF];
   char token[MAXBUF];
@@ -82,15 +190,122 @@ struct config {
   long gid;
   long cache;
   bool syslog;
-  char **shared_users;
+  char shared_users[OCTOPASS_MAX_NAMES][OCTOPASS_MAX_NAME];
   int shared_users_count;
+  char teams[OCTOPASS_MAX_NAMES][OCTOPASS_MAX_NAME];
+  long teams_gid[OCTOPASS_MAX_NAMES];
+  int teams_count;
+  bool refresh; // fetch even when the cache is fresh
+  char webhook_secret[MAXBUF];
+  long webhook_port;
+  bool incremental; // apply the audit log to the cached members instead of fetching them
+  long resync;
+  char bundle_key[MAXBUF];        // Ed25519 private key of the builder, PEM
+  char bundle_public_key[MAXBUF]; // its public key, PEM, on hosts importing bundles
+  long proxy_port;
+  char proxy_listen[MAXBUF]; // address `octopass proxy` binds
+  const struct cache_backend *backend;
+  char cache_server[MAXBUF];
+  char cache_password[MAXBUF]; // AUTH of the redis backend
+  long cache_max_entries;
+  long long cache_max_size;
+  bool cache_compress; // keep responses compressed by the file stores
+};
+
+// A linux group made of the members of one team (or of the repository collaborators).
+struct team {
+  char *name;
+  long gid;
+  json_t *members;
+  json_t *logins; // login -> true, for membership checks
+  size_t logins_len; // bytes of all logins including their terminators
+};
+
+// Members of a team as cached, while the audit log is applied to them.
+struct cached_team {
+  char *name;
+  char slug[MAXBUF * 2]; // "org/team-slug", as the audit log names teams
+  char key[MAXBUF * 4];
+  json_t *members;
+};
+
+// A response of GitHub kept by the proxy, revalidated with its ETag when stale.
+struct proxy_entry {
+  char *key; // path and sha256 of the token
+  char *body;
+  size_t len;
+  char etag[MAXBUF];
+  time_t fetched_at;
+  bool fetching; // a request is upstream, the others of the key wait for it
+  int refs;
+  struct proxy_entry *next;
 };
 
+struct proxy {
+  struct config *con;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct proxy_entry *buckets[OCTOPASS_PROXY_BUCKETS];
+  size_t count;
+};
+
+// Bloom filter over member logins, written next to the cache at each refresh,
+// so that lookups of other names are answered without loading the members.
+// A false positive only falls through to the regular lookup.
+#define OCTOPASS_PRESENCE_MAGIC "octoprs1"
+#define OCTOPASS_PRESENCE_HASHES 7
+#define OCTOPASS_PRESENCE_BITS_PER_LOGIN 10
+struct presence {
+  char magic[8];
+  uint64_t key_hash; // config the filter was built for
+  int64_t max_id; // largest github id, uids above it are not members
+  uint32_t nbits;
+  uint32_t hashes;
+  unsigned char bits[];
+};
+
+// Parsed member list shared by readers. The members are never modified after
+// loading, so it is released only when the last reference is dropped.
+struct snapshot {
+  json_t *members;
+  struct team *teams; // the first one is the group of Team or Repository
+  int teams_count;
+  json_t *team_by_name; // group name -> index of teams
+  json_t *team_by_gid;  // gid -> index of teams
+  json_t *member_by_name; // login -> member of members, shared by passwd and shadow
+  json_t *member_by_id;   // github id -> member of members
+  struct presence *presence;
+  char *key;
+  time_t loaded_at;
+  ino_t generation_ino; // generation file seen before loading, see octopass_generation_file
+  struct timespec generation_mtime;
+  volatile long refcount;
+};
+
+extern const struct cache_backend octopass_file_backend;
+extern const struct cache_backend octopass_shm_backend;
+extern const struct cache_backend octopass_redis_backend;
+extern const struct cache_backend *octopass_cache_backend(const char *name);
+
 extern int octopass_members(struct config *con, struct response *res);
+extern int octopass_config_load(struct config *con, char *filename);
 extern void octopass_config_loading(struct config *con, char *filename);
+extern int octopass_config_load_cached(struct config *con, char *filename);
 extern json_t *octopass_github_team_member_by_name(char *name, json_t *root);
 extern json_t *octopass_github_team_member_by_id(int gh_id, json_t *root);
 int octopass_autentication_with_token(struct config *con, char *user, char *token);
 extern char *express_github_user_keys(struct config *con, char *user);
+extern struct snapshot *octopass_snapshot_new(struct config *con, json_t *members);
+extern struct snapshot *octopass_snapshot_load(struct config *con);
+extern json_t *octopass_snapshot_member_by_name(struct snapshot *snap, const char *name);
+extern json_t *octopass_snapshot_member_by_id(struct snapshot *snap, long gh_id);
+extern struct team *octopass_snapshot_team_by_name(struct snapshot *snap, const char *name);
+extern struct team *octopass_snapshot_team_by_gid(struct snapshot *snap, long gid);
+extern struct snapshot *octopass_snapshot_acquire(struct config *con);
+extern void octopass_snapshot_publish(struct snapshot *snap);
+extern struct snapshot *octopass_snapshot_ref(struct snapshot *snap);
+extern int octopass_presence_lookup(struct config *con, const char *name);
+extern int octopass_presence_lookup_id(struct config *con, long gh_id);
+extern void octopass_snapshot_unref(struct snapshot *snap);
 
 #endif /* OCTOPASS_H */
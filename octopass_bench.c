@@ -0,0 +1,158 @@
+/* Management linux user and authentication with the organization/team on Github.
+   Copyright (C) 2017 Tomohisa Oda
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Measures the cost of NSS lookups, with the same config and environment as the tests,
+// and what compressing members saves on the wire and on disk.
+// Usage: bench [iterations]
+
+#define OCTOPASS_CONFIG_FILE "test/octopass.conf"
+#include "octopass.c"
+#include "nss_octopass-passwd.c"
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_getpwuid(const char *label, uid_t uid, int n)
+{
+  struct passwd pwent;
+  char buf[2048];
+  int err;
+  enum nss_status status = _nss_octopass_getpwuid_r(uid, &pwent, buf, sizeof(buf), &err);
+
+  double start = now_ns();
+  int i;
+  for (i = 0; i < n; i++) {
+    _nss_octopass_getpwuid_r(uid, &pwent, buf, sizeof(buf), &err);
+  }
+  double elapsed = now_ns() - start;
+
+  printf("%-32s uid=%-10u status=%2d %12.0f ns/op\n", label, uid, status, elapsed / n);
+}
+
+static void bench_getpwnam(const char *label, const char *name, int n)
+{
+  struct passwd pwent;
+  char buf[2048];
+  int err;
+  enum nss_status status = _nss_octopass_getpwnam_r(name, &pwent, buf, sizeof(buf), &err);
+
+  double start = now_ns();
+  int i;
+  for (i = 0; i < n; i++) {
+    _nss_octopass_getpwnam_r(name, &pwent, buf, sizeof(buf), &err);
+  }
+  double elapsed = now_ns() - start;
+
+  printf("%-32s name=%-9s status=%2d %12.0f ns/op\n", label, name, status, elapsed / n);
+}
+
+// Members as GitHub lists them, of a team of count.
+static char *bench_members(int count)
+{
+  struct buffer json = { 0 };
+  octopass_buffer_append_str(&json, "[");
+  int i;
+  for (i = 0; i < count; i++) {
+    char member[MAXBUF];
+    snprintf(member, sizeof(member),
+             "%s{\"login\":\"member%d\",\"id\":%d,\"node_id\":\"MDQ6VXNlcj%07d\","
+             "\"avatar_url\":\"https://avatars.githubusercontent.com/u/%d?v=4\",\"gravatar_id\":\"\","
+             "\"url\":\"https://api.github.com/users/member%d\",\"html_url\":\"https://github.com/member%d\","
+             "\"followers_url\":\"https://api.github.com/users/member%d/followers\","
+             "\"repos_url\":\"https://api.github.com/users/member%d/repos\",\"type\":\"User\",\"site_admin\":false}",
+             i == 0 ? "" : ",", i, 1000000 + i, i, 1000000 + i, i, i, i, i);
+    octopass_buffer_append_str(&json, member);
+  }
+  octopass_buffer_append_str(&json, "]");
+  return json.data;
+}
+
+static void bench_decode(const char *label, const char *data, size_t len, bool compressed, int n)
+{
+  double start = now_ns();
+  int i;
+  for (i = 0; i < n; i++) {
+    size_t raw_len = len;
+    char *raw      = compressed ? octopass_uncompress(OCTOPASS_CACHE_MAGIC, data, len, OCTOPASS_MAX_BUFFER_SIZE, &raw_len)
+                                : (char *)data;
+    json_error_t error;
+    json_t *root = json_loadb(raw, raw_len, 0, &error);
+    json_decref(root);
+    if (compressed) {
+      free(raw);
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  printf("%-32s %10lu bytes %12.0f ns/op\n", label, (unsigned long)len, elapsed / n);
+}
+
+// Raw JSON against the gzip GitHub sends with Accept-Encoding and the
+// CacheCompress format, for 10k members.
+static void bench_compress(int n)
+{
+  char *json = bench_members(10000);
+  size_t len = strlen(json);
+
+  size_t wire;
+  char *gz = octopass_gzip(json, len, &wire);
+  printf("%-32s %10lu bytes\n", "wire raw", (unsigned long)len);
+  printf("%-32s %10lu bytes\n", "wire gzip", (unsigned long)wire);
+  free(gz);
+
+  int levels[] = { 1, OCTOPASS_CACHE_COMPRESS_LEVEL, 9 };
+  int i;
+  for (i = 0; i < 3; i++) {
+    size_t zlen;
+    double start     = now_ns();
+    unsigned char *z = octopass_compress(OCTOPASS_CACHE_MAGIC, json, len, levels[i], &zlen);
+    double elapsed   = now_ns() - start;
+    char label[64];
+    snprintf(label, sizeof(label), "disk compressed (level %d)", levels[i]);
+    printf("%-32s %10lu bytes %12.0f ns to encode\n", label, (unsigned long)zlen, elapsed);
+    if (levels[i] == OCTOPASS_CACHE_COMPRESS_LEVEL) {
+      bench_decode("decode compressed", (char *)z, zlen, true, n);
+    }
+    free(z);
+  }
+  bench_decode("decode raw", json, len, false, n);
+
+  free(json);
+}
+
+int main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : 10000;
+  if (n <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  bench_getpwuid("getpwuid miss (system uid)", 0, n);
+  bench_getpwuid("getpwuid miss (below range)", con.uid_starts - 1, n);
+  bench_getpwuid("getpwuid miss (above members)", con.uid_starts + 0x7fffffff, n);
+  bench_getpwnam("getpwnam miss", "postgres", n);
+  bench_compress(n / 1000 > 0 ? n / 1000 : 1);
+
+  return 0;
+}
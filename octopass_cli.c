@@ -14,7 +14,11 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
-#include "octopass.c"
+#include "octopass_server.c"
+#include <netinet/in.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/socket.h>
 static pthread_mutex_t OCTOPASS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 
 #define no_argument 0
@@ -43,10 +47,17 @@ void help(void)
   printf("\n");
   printf("Commands:\n");
   printf("  [USER]         get public keys from github\n");
+  printf("  [USER] [FP|KEY] get the public key matching a fingerprint (%%f) or key (%%k) of sshd\n");
   printf("  pam [user]     receive the password from stdin and return the auth result with the exit status\n");
   printf("  passwd [key]   displays passwd entries as octopass nss module\n");
   printf("  shadow [key]   displays shadow passwd entries as octopass nss module\n");
   printf("  group [key]    displays group entries as octopass nss module\n");
+  printf("  refresh [loop] refreshes the cache ahead of expiry after a per-host delay, once or repeatedly\n");
+  printf("  webhook [port] receives github webhooks on localhost and applies membership changes to the cache\n");
+  printf("  proxy [port]   serves the github endpoints of octopass to other hosts from a shared cache\n");
+  printf("  userdb [socket] serves users and groups to systemd-userdbd over varlink\n");
+  printf("  snapshot export [file] refreshes the cache and writes it to a signed bundle\n");
+  printf("  snapshot import [file] verifies a bundle and installs it into the cache\n");
   printf("\n");
   printf("Options:\n");
   printf("  -h, --help     show this help message and exit\n");
@@ -54,36 +65,51 @@ void help(void)
   printf("\n");
 }
 
-int octopass_public_keys_unlocked(char *name)
+int octopass_public_keys_unlocked(char *name, char *fingerprint)
 {
   struct config con;
   octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
 
-  if (con.shared_users_count > 0) {
-    int idx;
-    for (idx = 0; idx < con.shared_users_count; idx++) {
-      if (strcmp(name, con.shared_users[idx]) == 0) {
-        const char *members_keys = octopass_github_team_members_keys(&con);
-        if (members_keys != NULL) {
-          printf("%s", members_keys);
-        }
+  if (con.cache > 0) {
+    char file[MAXBUF * 4];
+    if (fingerprint == NULL) {
+      octopass_keys_file(&con, name, file, sizeof(file));
+      if (octopass_file_is_fresh(&con, file) && octopass_send_file(file, STDOUT_FILENO) == 0) {
+        return 0;
+      }
+    } else {
+      octopass_fingerprints_file(&con, name, file, sizeof(file));
+      FILE *fp = octopass_file_is_fresh(&con, file) ? fopen(file, "r") : NULL;
+      if (fp != NULL) {
+        octopass_fingerprint_lookup(fp, fingerprint, stdout);
+        fclose(fp);
         return 0;
       }
     }
   }
 
-  const char *keys = octopass_github_user_keys(&con, name);
-  if (keys != NULL) {
-    printf("%s", keys);
+  char *index      = NULL;
+  const char *keys = octopass_render_keys(&con, name, &index);
+  if (fingerprint == NULL) {
+    if (keys != NULL) {
+      printf("%s", keys);
+    }
+  } else if (index != NULL && strlen(index) > 0) {
+    FILE *fp = fmemopen(index, strlen(index), "r");
+    if (fp != NULL) {
+      octopass_fingerprint_lookup(fp, fingerprint, stdout);
+      fclose(fp);
+    }
   }
+  free(index);
 
   return 0;
 }
 
-int octopass_public_keys(char *name)
+int octopass_public_keys(char *name, char *fingerprint)
 {
   OCTOPASS_LOCK();
-  int res = octopass_public_keys_unlocked(name);
+  int res = octopass_public_keys_unlocked(name, fingerprint);
   OCTOPASS_UNLOCK();
   return res;
 }
@@ -121,6 +147,318 @@ int octopass_authentication(int argc, char **argv)
   return res;
 }
 
+int octopass_refresh_command(int argc, char **argv)
+{
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  if (con.cache == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Cache is disabled\n");
+    return 2;
+  }
+
+  bool loop = argc > 2 && strcmp(argv[2], "loop") == 0;
+  // Refresh each period a quarter before the cache expires.
+  long interval = con.cache - con.cache / 4;
+
+  sleep(octopass_refresh_jitter(&con));
+  do {
+    if (octopass_refresh(&con) != 0) {
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Refresh failure\n");
+      if (!loop) {
+        return 1;
+      }
+    }
+    // Keeps the cache within its budget, whatever users have come and gone.
+    con.backend->gc(&con);
+    if (loop) {
+      sleep(interval > 0 ? interval : 1);
+    }
+  } while (loop);
+
+  return 0;
+}
+
+int octopass_webhook_command(int argc, char **argv)
+{
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  if (strlen(con.webhook_secret) == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "WebhookSecret is required\n");
+    return 2;
+  }
+  if (con.cache == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Cache is disabled\n");
+    return 2;
+  }
+
+  long port = argc > 2 ? atol(argv[2]) : con.webhook_port;
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Invalid port: %ld\n", port);
+    return 2;
+  }
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+    return 1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  // Only local, a reverse proxy terminating TLS is expected in front of it.
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+    close(sock);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  // Deliveries are applied one at a time, in the order they arrive.
+  while (1) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+      break;
+    }
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    octopass_webhook_receive(&con, fd);
+    close(fd);
+  }
+
+  close(sock);
+  return 1;
+}
+
+struct worker_connection {
+  void (*serve)(void *ctx, int fd);
+  void *ctx;
+  int fd;
+  sem_t *slots;
+};
+
+static void *octopass_connection_worker(void *arg)
+{
+  struct worker_connection *c = (struct worker_connection *)arg;
+  c->serve(c->ctx, c->fd);
+  close(c->fd);
+  sem_post(c->slots);
+  free(c);
+  return NULL;
+}
+
+// Serves each connection of sock by a thread, at most workers at a time: further
+// connections wait in the backlog of the socket until a worker is done.
+// Returns only when accept fails.
+static void octopass_serve_connections(int sock, int workers, void (*serve)(void *ctx, int fd), void *ctx)
+{
+  sem_t *slots = malloc(sizeof(sem_t));
+  if (slots == NULL || sem_init(slots, 0, workers) == -1) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+    free(slots);
+    return;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (1) {
+    if (sem_wait(slots) == -1) {
+      continue;
+    }
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+      sem_post(slots);
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+      break;
+    }
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    pthread_t thread;
+    struct worker_connection *c = malloc(sizeof(*c));
+    if (c == NULL) {
+      close(fd);
+      sem_post(slots);
+      continue;
+    }
+    c->serve = serve;
+    c->ctx   = ctx;
+    c->fd    = fd;
+    c->slots = slots;
+    if (pthread_create(&thread, &attr, octopass_connection_worker, c) != 0) {
+      close(fd);
+      free(c);
+      sem_post(slots);
+    }
+  }
+
+  // Detached workers may still use ctx and the slots, so they are left to the exit.
+  pthread_attr_destroy(&attr);
+}
+
+static void octopass_userdb_serve(void *ctx, int fd)
+{
+  octopass_userdb_receive((struct config *)ctx, fd);
+}
+
+static void octopass_proxy_serve(void *ctx, int fd)
+{
+  octopass_proxy_receive((struct proxy *)ctx, fd);
+}
+
+int octopass_proxy_command(int argc, char **argv)
+{
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  long port = argc > 2 ? atol(argv[2]) : con.proxy_port;
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Invalid port: %ld\n", port);
+    return 2;
+  }
+
+  // Loopback unless ProxyListen says otherwise, TLS is expected to be terminated in front of it.
+  char service[32];
+  snprintf(service, sizeof(service), "%ld", port);
+  struct addrinfo hints;
+  struct addrinfo *ai = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE | AI_NUMERICHOST;
+  if (getaddrinfo(con.proxy_listen, service, &hints, &ai) != 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Invalid ProxyListen: %s\n", con.proxy_listen);
+    return 2;
+  }
+
+  int sock = socket(ai->ai_family, SOCK_STREAM, 0);
+  if (sock == -1) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+    freeaddrinfo(ai);
+    return 1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(sock, ai->ai_addr, ai->ai_addrlen) == -1 || listen(sock, 128) == -1) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+    freeaddrinfo(ai);
+    close(sock);
+    return 1;
+  }
+  freeaddrinfo(ai);
+  signal(SIGPIPE, SIG_IGN);
+  // Connections are served by threads, libcurl must be initialized before them.
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  struct proxy proxy;
+  octopass_proxy_init(&proxy, &con);
+
+  // Workers may still use the proxy when accept fails, so it is left to the exit.
+  octopass_serve_connections(sock, OCTOPASS_PROXY_WORKERS, octopass_proxy_serve, &proxy);
+
+  close(sock);
+  return 1;
+}
+
+// Listens on the socket passed by systemd when socket activated, or binds one.
+int octopass_userdb_command(int argc, char **argv)
+{
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  int sock         = -1;
+  const char *fds  = getenv("LISTEN_FDS");
+  const char *pid  = getenv("LISTEN_PID");
+  const char *path = argc > 2 ? argv[2] : OCTOPASS_USERDB_SOCKET;
+  if (fds != NULL && pid != NULL && atoi(fds) == 1 && atol(pid) == (long)getpid()) {
+    sock = 3;
+  } else {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Invalid socket: %s\n", path);
+      return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    // Everyone resolves users, as with NSS.
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, 0666) == -1 ||
+        listen(sock, 128) == -1) {
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "%s\n", strerror(errno));
+      if (sock != -1) {
+        close(sock);
+      }
+      return 1;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+  // Connections are served by threads, libcurl must be initialized before them.
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  octopass_serve_connections(sock, OCTOPASS_USERDB_WORKERS, octopass_userdb_serve, &con);
+
+  close(sock);
+  return 1;
+}
+
+int octopass_snapshot_command(int argc, char **argv)
+{
+  if (argc < 4 || (strcmp(argv[2], "export") != 0 && strcmp(argv[2], "import") != 0)) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Usage: octopass snapshot export|import [file]\n");
+    return 2;
+  }
+
+  struct config con;
+  octopass_config_loading(&con, OCTOPASS_CONFIG_FILE);
+
+  bool exporting = strcmp(argv[2], "export") == 0;
+  if (exporting && strlen(con.bundle_key) == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "BundleKey is required\n");
+    return 2;
+  }
+  if (!exporting && strlen(con.bundle_public_key) == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "BundlePublicKey is required\n");
+    return 2;
+  }
+  if (con.cache == 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Cache is disabled\n");
+    return 2;
+  }
+
+  if (exporting) {
+    if (octopass_refresh(&con) != 0 || octopass_bundle_export(&con, argv[3]) != 0) {
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Export failure: %s\n", argv[3]);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (octopass_bundle_import(&con, argv[3]) != 0) {
+    fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Import failure: %s\n", argv[3]);
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   if (argc < 2 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
@@ -136,8 +474,6 @@ int main(int argc, char **argv)
   // PASSWD
   if (strcmp(argv[1], "passwd") == 0) {
     if (argc < 3) {
-      // trying to debug https://github.com/linyows/octopass/issues/28
-      printf("\nHi there, I'm an innocent message printed by passwd cli without args\n\n");
       call_pwlist();
     } else {
       long id = atol(argv[2]);
@@ -182,11 +518,44 @@ int main(int argc, char **argv)
     return 0;
   }
 
+  // REFRESH
+  if (strcmp(argv[1], "refresh") == 0) {
+    return octopass_refresh_command(argc, argv);
+  }
+
+  // WEBHOOK
+  if (strcmp(argv[1], "webhook") == 0) {
+    return octopass_webhook_command(argc, argv);
+  }
+
+  // PROXY
+  if (strcmp(argv[1], "proxy") == 0) {
+    return octopass_proxy_command(argc, argv);
+  }
+
+  // USERDB
+  if (strcmp(argv[1], "userdb") == 0) {
+    return octopass_userdb_command(argc, argv);
+  }
+
+  // SNAPSHOT
+  if (strcmp(argv[1], "snapshot") == 0) {
+    return octopass_snapshot_command(argc, argv);
+  }
+
   // PAM
   if (strcmp(argv[1], "pam") == 0) {
     return octopass_authentication(argc, argv);
   }
 
   // PUBLIC KEYS
-  return octopass_public_keys((char *)argv[1]);
+  if (argc > 2) {
+    char fingerprint[OCTOPASS_FINGERPRINT_LEN];
+    if (octopass_fingerprint_arg(argv[argc - 1], fingerprint) != 0) {
+      fprintf(stderr, ANSI_COLOR_RED "Error: " ANSI_COLOR_RESET "Invalid fingerprint or key: %s\n", argv[argc - 1]);
+      return 2;
+    }
+    return octopass_public_keys((char *)argv[1], fingerprint);
+  }
+  return octopass_public_keys((char *)argv[1], NULL);
 }
@@ -0,0 +1,1222 @@
+/* Management linux user and authentication with the organization/team on Github.
+   Copyright (C) 2017 Tomohisa Oda
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+// The daemons and bundles of the octopass command: the webhook receiver, the
+// proxy, the userdb service and snapshot bundles. They are never linked into
+// the NSS and PAM modules.
+
+#include "octopass.c"
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+
+// Signs data with a secret as "sha256=" and the hex HMAC-SHA256, the form of
+// X-Hub-Signature-256. signature needs 72 bytes.
+// OK: 0
+// NG: -1
+int octopass_signature(const char *secret, const void *data, size_t len, char *signature)
+{
+  unsigned char mac[32];
+  if (HMAC(EVP_sha256(), secret, strlen(secret), (const unsigned char *)data, len, mac, NULL) == NULL) {
+    return -1;
+  }
+
+  strcpy(signature, "sha256=");
+  int i;
+  for (i = 0; i < 32; i++) {
+    sprintf(signature + strlen("sha256=") + i * 2, "%02x", mac[i]);
+  }
+  return 0;
+}
+
+// Checks a signature made by octopass_signature, in constant time.
+// OK: 0
+// NG: -1
+int octopass_signature_verify(const char *secret, const void *data, size_t len, const char *signature)
+{
+  char expected[72];
+  if (strlen(secret) == 0 || signature == NULL || octopass_signature(secret, data, len, expected) != 0 ||
+      strlen(signature) != strlen(expected)) {
+    return -1;
+  }
+
+  unsigned char diff = 0;
+  size_t i;
+  for (i = 0; i < strlen(expected); i++) {
+    diff |= expected[i] ^ signature[i];
+  }
+
+  return diff == 0 ? 0 : -1;
+}
+
+// Checks X-Hub-Signature-256 against the payload.
+// OK: 0
+// NG: -1
+int octopass_webhook_verify(struct config *con, const char *body, size_t len, const char *signature)
+{
+  return octopass_signature_verify(con->webhook_secret, body, len, signature);
+}
+
+static bool octopass_webhook_is_own_team(struct config *con, const char *team)
+{
+  if (team == NULL) {
+    return false;
+  }
+  if (strcmp(con->team, team) == 0) {
+    return true;
+  }
+
+  int i;
+  for (i = 0; i < con->teams_count; i++) {
+    if (strcmp(con->teams[i], team) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Applies a verified webhook payload of the membership, team, member or
+// organization events. The members are fetched again and processes holding
+// them reload, then the access of a login that is no longer a member is
+// removed at once. When the members cannot be fetched, it is removed anyway.
+// Applied: 0
+// Not about the members of the config: 1
+// NG: -1
+// Invalid payload: -2
+int octopass_webhook_handle(struct config *con, const char *event, const char *body)
+{
+  json_error_t error;
+  json_t *payload = json_loads(body, 0, &error);
+  if (!json_is_object(payload)) {
+    json_decref(payload);
+    return -2;
+  }
+
+  json_t *j_repo     = json_object_get(payload, "repository");
+  const char *action = json_string_value(json_object_get(payload, "action"));
+  const char *org    = json_string_value(json_object_get(json_object_get(payload, "organization"), "login"));
+  const char *team   = json_string_value(json_object_get(json_object_get(payload, "team"), "name"));
+  const char *team_was =
+      json_string_value(json_object_get(json_object_get(json_object_get(payload, "changes"), "name"), "from"));
+  const char *repo  = json_string_value(json_object_get(j_repo, "name"));
+  const char *owner = json_string_value(json_object_get(json_object_get(j_repo, "owner"), "login"));
+  const char *login = NULL;
+
+  bool use_repository = strlen(con->repository) > 0;
+  bool own_org        = org != NULL && strcasecmp(org, use_repository ? con->owner : con->organization) == 0;
+  bool own_repo       = use_repository && repo != NULL && owner != NULL && strcasecmp(repo, con->repository) == 0 &&
+                  strcasecmp(owner, con->owner) == 0;
+  bool own_team       = octopass_webhook_is_own_team(con, team) || octopass_webhook_is_own_team(con, team_was);
+  bool affected       = false;
+
+  if (strcmp(event, "membership") == 0) {
+    login    = json_string_value(json_object_get(json_object_get(payload, "member"), "login"));
+    affected = !use_repository && own_org && own_team;
+  } else if (strcmp(event, "team") == 0) {
+    affected = use_repository ? own_repo : own_org && own_team;
+  } else if (strcmp(event, "member") == 0) {
+    login    = json_string_value(json_object_get(json_object_get(payload, "member"), "login"));
+    affected = own_repo;
+  } else if (strcmp(event, "organization") == 0) {
+    login = json_string_value(
+        json_object_get(json_object_get(json_object_get(payload, "membership"), "user"), "login"));
+    affected = own_org && action != NULL && strncmp(action, "member_", strlen("member_")) == 0;
+  }
+
+  if (!affected) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "webhook ignored: %s", event);
+    }
+    json_decref(payload);
+    return 1;
+  }
+
+  con->refresh          = true;
+  struct snapshot *snap = octopass_snapshot_load(con);
+  con->refresh          = false;
+
+  if (snap == NULL) {
+    if (login != NULL) {
+      octopass_purge_user(con, login);
+    }
+    if (con->syslog) {
+      syslog(LOG_INFO, "webhook not applied, members not available: %s", event);
+    }
+    json_decref(payload);
+    return -1;
+  }
+  octopass_snapshot_publish(snap);
+
+  int status = octopass_generation_bump(con);
+  if (octopass_members_diff_apply(con, snap, true) == -1) {
+    status = -1;
+  }
+  octopass_content_apply(con, snap, OCTOPASS_NSCD_SOCKET);
+  // Also when it left before the previous members were recorded.
+  if (login != NULL && octopass_snapshot_member_by_name(snap, login) == NULL) {
+    octopass_purge_user(con, login);
+  }
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "webhook applied: %s %s %s", event, action != NULL ? action : "-", login != NULL ? login : "-");
+  }
+  octopass_snapshot_unref(snap);
+  json_decref(payload);
+
+  return status == 0 ? 0 : -1;
+}
+
+// Copies the value of a header of a request head to value.
+// OK: 0
+// NG: -1
+static int octopass_http_header(const char *head, const char *name, char *value, size_t len)
+{
+  const char *line = strstr(head, "\r\n");
+  while (line != NULL) {
+    line += 2;
+    const char *end = strstr(line, "\r\n");
+    if (end == NULL) {
+      end = line + strlen(line);
+    }
+    if (end == line) {
+      break;
+    }
+
+    const char *colon = memchr(line, ':', end - line);
+    if (colon != NULL && (size_t)(colon - line) == strlen(name) && strncasecmp(line, name, strlen(name)) == 0) {
+      const char *v = colon + 1;
+      while (v < end && (*v == ' ' || *v == '\t')) {
+        v++;
+      }
+      snprintf(value, len, "%.*s", (int)(end - v), v);
+      return 0;
+    }
+    line = *end == '\0' ? NULL : end;
+  }
+
+  return -1;
+}
+
+// encoding is the Content-Encoding of body, NULL when it is not encoded.
+static void octopass_http_respond_with(int fd, int code, const char *reason, const char *etag, const char *encoding,
+                                       const char *body, size_t len)
+{
+  char head[MAXBUF * 2];
+  int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n", code, reason);
+  if (len > 0) {
+    n += snprintf(head + n, sizeof(head) - n, "Content-Type: application/json; charset=utf-8\r\n");
+  }
+  if (encoding != NULL) {
+    n += snprintf(head + n, sizeof(head) - n, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", encoding);
+  }
+  if (etag != NULL && strlen(etag) > 0) {
+    n += snprintf(head + n, sizeof(head) - n, "ETag: %.*s\r\n", MAXBUF - 1, etag);
+  }
+  n += snprintf(head + n, sizeof(head) - n, "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)len);
+
+  if (octopass_write_all(fd, head, n) == 0 && len > 0) {
+    octopass_write_all(fd, body, len);
+  }
+}
+
+static void octopass_http_respond(int fd, int code, const char *reason)
+{
+  octopass_http_respond_with(fd, code, reason, NULL, NULL, NULL, 0);
+}
+
+// Reads one webhook delivery from a connected socket, applies it and
+// responds. Returns the HTTP status code responded.
+int octopass_webhook_receive(struct config *con, int fd)
+{
+  struct buffer req = { 0 };
+  char chunk[8192];
+  char *head_end     = NULL;
+  size_t head_len    = 0;
+  size_t length      = 0;
+  int code           = 400;
+  const char *reason = "Bad Request";
+
+  while (1) {
+    if (head_end == NULL && req.len > 0) {
+      head_end = strstr(req.data, "\r\n\r\n");
+      if (head_end != NULL) {
+        head_len  = head_end - req.data + 4;
+        *head_end = '\0';
+
+        char value[MAXBUF];
+        if (octopass_http_header(req.data, "Content-Length", value, sizeof(value)) != 0) {
+          code   = 411;
+          reason = "Length Required";
+          break;
+        }
+        length = strtoul(value, NULL, 10);
+        if (length > OCTOPASS_WEBHOOK_MAX_PAYLOAD) {
+          code   = 413;
+          reason = "Payload Too Large";
+          break;
+        }
+      } else if (req.len > sizeof(chunk) * 8) {
+        break;
+      }
+    }
+    if (head_end != NULL && req.len >= head_len + length) {
+      break;
+    }
+
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || octopass_buffer_append(&req, chunk, n) != 0) {
+      break;
+    }
+  }
+
+  if (head_end != NULL && req.len >= head_len + length) {
+    char event[MAXBUF];
+    char signature[MAXBUF];
+    char *body   = req.data + head_len;
+    body[length] = '\0';
+
+    if (strncmp(req.data, "POST ", strlen("POST ")) != 0) {
+      code   = 405;
+      reason = "Method Not Allowed";
+    } else if (octopass_http_header(req.data, "X-Hub-Signature-256", signature, sizeof(signature)) != 0 ||
+               octopass_webhook_verify(con, body, length, signature) != 0) {
+      code   = 401;
+      reason = "Unauthorized";
+    } else if (octopass_http_header(req.data, "X-GitHub-Event", event, sizeof(event)) != 0) {
+      code   = 400;
+      reason = "Bad Request";
+    } else if (strcmp(event, "ping") == 0) {
+      code   = 204;
+      reason = "No Content";
+    } else {
+      int status = octopass_webhook_handle(con, event, body);
+      if (status >= 0) {
+        code   = 204;
+        reason = "No Content";
+      } else if (status == -1) {
+        code   = 500;
+        reason = "Internal Server Error";
+      }
+    }
+  }
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- status: %d", __func__, __LINE__, code);
+  }
+  octopass_http_respond(fd, code, reason);
+  free(req.data);
+
+  return code;
+}
+
+void octopass_proxy_init(struct proxy *p, struct config *con)
+{
+  memset(p, 0, sizeof(*p));
+  p->con = con;
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
+}
+
+static void octopass_proxy_entry_free(struct proxy_entry *e)
+{
+  free(e->key);
+  free(e->body);
+  free(e);
+}
+
+void octopass_proxy_free(struct proxy *p)
+{
+  int i;
+  for (i = 0; i < OCTOPASS_PROXY_BUCKETS; i++) {
+    struct proxy_entry *e = p->buckets[i];
+    while (e != NULL) {
+      struct proxy_entry *next = e->next;
+      octopass_proxy_entry_free(e);
+      e = next;
+    }
+    p->buckets[i] = NULL;
+  }
+  p->count = 0;
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
+}
+
+// Whether a path, without the leading slash, is one that octopass requests.
+// Nothing else is forwarded with the token of a client.
+bool octopass_proxy_allowed(const char *path)
+{
+  const char *patterns[] = { "orgs/*/teams", "teams/*/members", "repos/*/*/collaborators", "users/*/keys", "users/*",
+                             "user" };
+  const char *c;
+  for (c = path; *c != '\0'; c++) {
+    if (!isalnum((unsigned char)*c) && strchr("-._~%&=?/", *c) == NULL) {
+      return false;
+    }
+  }
+
+  char resource[strlen(path) + 1];
+  snprintf(resource, sizeof(resource), "%.*s", (int)strcspn(path, "?"), path);
+
+  size_t i;
+  for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    if (fnmatch(patterns[i], resource, FNM_PATHNAME | FNM_PERIOD) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Responses are kept per token, a client never gets what another token fetched.
+static char *octopass_proxy_key(const char *path, const char *token)
+{
+  unsigned char digest[32];
+  EVP_Digest(token, strlen(token), digest, NULL, EVP_sha256(), NULL);
+
+  char *key = malloc(strlen(path) + sizeof(digest) * 2 + 2);
+  if (key == NULL) {
+    return NULL;
+  }
+  int n = sprintf(key, "%s ", path);
+  size_t i;
+  for (i = 0; i < sizeof(digest); i++) {
+    n += sprintf(key + n, "%02x", digest[i]);
+  }
+
+  return key;
+}
+
+// Drops entries nobody is using, the stale ones only unless all is set.
+// Called with the mutex held.
+static void octopass_proxy_sweep(struct proxy *p, bool all)
+{
+  time_t now = time(NULL);
+  int i;
+  for (i = 0; i < OCTOPASS_PROXY_BUCKETS; i++) {
+    struct proxy_entry **e = &p->buckets[i];
+    while (*e != NULL) {
+      if ((*e)->refs == 0 && (all || now - (*e)->fetched_at >= p->con->cache)) {
+        struct proxy_entry *drop = *e;
+        *e                       = drop->next;
+        octopass_proxy_entry_free(drop);
+        p->count--;
+      } else {
+        e = &(*e)->next;
+      }
+    }
+  }
+}
+
+// Finds or adds the entry of a key and takes a reference to it.
+// Called with the mutex held, NULL when out of memory.
+static struct proxy_entry *octopass_proxy_entry(struct proxy *p, char *key)
+{
+  uint64_t bucket = octopass_hash(key, 0) % OCTOPASS_PROXY_BUCKETS;
+
+  struct proxy_entry *e;
+  for (e = p->buckets[bucket]; e != NULL; e = e->next) {
+    if (strcmp(e->key, key) == 0) {
+      e->refs++;
+      return e;
+    }
+  }
+
+  if (p->count >= OCTOPASS_PROXY_MAX_ENTRIES) {
+    octopass_proxy_sweep(p, false);
+  }
+  if (p->count >= OCTOPASS_PROXY_MAX_ENTRIES) {
+    octopass_proxy_sweep(p, true);
+  }
+
+  e = calloc(1, sizeof(*e));
+  if (e == NULL) {
+    return NULL;
+  }
+  e->key             = strdup(key);
+  e->refs            = 1;
+  e->next            = p->buckets[bucket];
+  p->buckets[bucket] = e;
+  p->count++;
+
+  return e;
+}
+
+// Unlinks an entry that holds no response once its last reference is gone.
+// Called with the mutex held.
+static void octopass_proxy_release(struct proxy *p, struct proxy_entry *e)
+{
+  e->refs--;
+  if (e->refs > 0 || e->body != NULL) {
+    return;
+  }
+
+  struct proxy_entry **link = &p->buckets[octopass_hash(e->key, 0) % OCTOPASS_PROXY_BUCKETS];
+  while (*link != e) {
+    link = &(*link)->next;
+  }
+  *link = e->next;
+  octopass_proxy_entry_free(e);
+  p->count--;
+}
+
+// Copies the response of GitHub to a path for a token to out, asking GitHub
+// only when the kept one is older than Cache, with its ETag. Concurrent
+// requests of one key wait for a single upstream request. Errors are not kept.
+// etag is a MAXBUF buffer. Returns the HTTP status for the client.
+long octopass_proxy_fetch(struct proxy *p, const char *path, const char *token, struct buffer *out, char *etag)
+{
+  struct config *con = p->con;
+  char *key          = octopass_proxy_key(path, token);
+  if (key == NULL) {
+    return 500;
+  }
+
+  pthread_mutex_lock(&p->mutex);
+  struct proxy_entry *e = octopass_proxy_entry(p, key);
+  free(key);
+  if (e == NULL) {
+    pthread_mutex_unlock(&p->mutex);
+    return 500;
+  }
+  while (e->fetching) {
+    pthread_cond_wait(&p->cond, &p->mutex);
+  }
+
+  // user authenticates the token, so it is always asked to GitHub.
+  bool is_user = strcmp(path, "user") == 0 || strncmp(path, "user?", strlen("user?")) == 0;
+  long status  = 200;
+  if (e->body == NULL || is_user || time(NULL) - e->fetched_at >= con->cache) {
+    char tag[MAXBUF];
+    snprintf(tag, sizeof(tag), "%s", e->body != NULL ? e->etag : "");
+    e->fetching = true;
+    pthread_mutex_unlock(&p->mutex);
+
+    char url[strlen(con->endpoint) + strlen(path) + 1];
+    sprintf(url, "%s%s", con->endpoint, path);
+    struct response res;
+    octopass_github_request_with_etag(con, url, &res, (char *)token, tag);
+    status = (long)res.httpstatus;
+
+    pthread_mutex_lock(&p->mutex);
+    if (status == 304 && e->body != NULL) {
+      e->fetched_at = time(NULL);
+      status        = 200;
+    } else if (status == 200) {
+      free(e->body);
+      e->body       = res.data;
+      e->len        = res.size;
+      e->fetched_at = time(NULL);
+      res.data      = NULL;
+      snprintf(e->etag, sizeof(e->etag), "%s", tag);
+    } else if (status == 0 && e->body != NULL && !is_user) {
+      // GitHub cannot be reached, the kept response is better than nothing.
+      status = 200;
+    } else if (octopass_buffer_append(out, res.data, res.size) != 0) {
+      status = 500;
+    } else if (status == 0) {
+      status = 502;
+    }
+    e->fetching = false;
+    pthread_cond_broadcast(&p->cond);
+    free(res.data);
+  }
+
+  if (status == 200) {
+    snprintf(etag, MAXBUF, "%s", e->etag);
+    if (octopass_buffer_append(out, e->body, e->len) != 0) {
+      status = 500;
+    }
+  }
+  octopass_proxy_release(p, e);
+  pthread_mutex_unlock(&p->mutex);
+
+  return status;
+}
+
+static const char *octopass_http_reason(long code)
+{
+  switch (code) {
+  case 200:
+    return "OK";
+  case 401:
+    return "Unauthorized";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 500:
+    return "Internal Server Error";
+  case 502:
+    return "Bad Gateway";
+  default:
+    return code < 400 ? "OK" : "Error";
+  }
+}
+
+// Reads one request of another host from a connected socket and responds
+// with the response of GitHub, as kept by the proxy.
+// Returns the HTTP status code responded.
+int octopass_proxy_receive(struct proxy *p, int fd)
+{
+  struct buffer req = { 0 };
+  char chunk[8192];
+  char *head_end = NULL;
+
+  while (head_end == NULL && req.len <= sizeof(chunk) * 8) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || octopass_buffer_append(&req, chunk, n) != 0) {
+      break;
+    }
+    head_end = strstr(req.data, "\r\n\r\n");
+  }
+
+  long code          = 400;
+  struct buffer body = { 0 };
+  char etag[MAXBUF]  = { 0 };
+  char path[MAXBUF];
+  char auth[MAXBUF];
+  char accept[MAXBUF] = { 0 };
+
+  if (head_end != NULL) {
+    head_end[2] = '\0';
+    size_t len  = strcspn(req.data, " \r");
+    char *uri   = req.data + len + (req.data[len] == ' ' ? 1 : 0);
+    snprintf(path, sizeof(path), "%.*s", (int)strcspn(uri, " \r"), uri);
+
+    if (len != strlen("GET") || strncmp(req.data, "GET", len) != 0) {
+      code = 405;
+    } else if (octopass_http_header(req.data, "Authorization", auth, sizeof(auth)) != 0) {
+      code = 401;
+    } else if (path[0] != '/' || !octopass_proxy_allowed(path + 1)) {
+      code = 404;
+    } else {
+      char *token = strchr(auth, ' ');
+      token       = token != NULL ? token + 1 : auth;
+      code        = octopass_proxy_fetch(p, path + 1, token, &body, etag);
+      octopass_http_header(req.data, "Accept-Encoding", accept, sizeof(accept));
+    }
+  }
+
+  // Clients on the other side of a slow link get members as gzip, as GitHub gives them.
+  size_t zlen = 0;
+  char *zbody = code == 200 && strstr(accept, "gzip") != NULL ? octopass_gzip(body.data, body.len, &zlen) : NULL;
+
+  if (p->con->syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- status: %ld", __func__, __LINE__, code);
+  }
+  if (zbody != NULL) {
+    octopass_http_respond_with(fd, code, octopass_http_reason(code), etag, "gzip", zbody, zlen);
+  } else {
+    octopass_http_respond_with(fd, code, octopass_http_reason(code), etag, NULL, body.data, body.len);
+  }
+  free(zbody);
+  free(body.data);
+  free(req.data);
+
+  return code;
+}
+
+// A JSON user record of systemd for a member, NULL when it is not one.
+static json_t *octopass_userdb_user(struct config *con, json_t *member)
+{
+  const char *login = json_string_value(json_object_get(member, "login"));
+  json_t *id        = json_object_get(member, "id");
+  if (login == NULL || !json_is_integer(id)) {
+    return NULL;
+  }
+
+  char home[MAXBUF * 2];
+  snprintf(home, sizeof(home), con->home, login);
+
+  json_t *record = json_object();
+  json_object_set_new(record, "userName", json_string(login));
+  json_object_set_new(record, "uid", json_integer(con->uid_starts + json_integer_value(id)));
+  json_object_set_new(record, "gid", json_integer(con->gid));
+  json_object_set_new(record, "realName", json_string("managed by octopass"));
+  json_object_set_new(record, "homeDirectory", json_string(home));
+  json_object_set_new(record, "shell", json_string(con->shell));
+  json_object_set_new(record, "disposition", json_string("regular"));
+  json_object_set_new(record, "service", json_string(OCTOPASS_USERDB_SERVICE));
+  return record;
+}
+
+// A JSON group record of systemd for a team, with its members.
+static json_t *octopass_userdb_group(struct team *team)
+{
+  json_t *members = json_array();
+  const char *login;
+  json_t *value;
+  json_object_foreach(team->logins, login, value)
+  {
+    json_array_append_new(members, json_string(login));
+  }
+
+  json_t *record = json_object();
+  json_object_set_new(record, "groupName", json_string(team->name));
+  json_object_set_new(record, "gid", json_integer(team->gid));
+  json_object_set_new(record, "members", members);
+  json_object_set_new(record, "disposition", json_string("regular"));
+  json_object_set_new(record, "service", json_string(OCTOPASS_USERDB_SERVICE));
+  return record;
+}
+
+static void octopass_userdb_reply(json_t *replies, json_t *record)
+{
+  json_t *reply = json_object();
+  json_object_set_new(reply, "record", record);
+  json_object_set_new(reply, "incomplete", json_false());
+  json_array_append_new(replies, reply);
+}
+
+static void octopass_userdb_membership(json_t *replies, const char *login, const char *group)
+{
+  json_t *reply = json_object();
+  json_object_set_new(reply, "userName", json_string(login));
+  json_object_set_new(reply, "groupName", json_string(group));
+  json_array_append_new(replies, reply);
+}
+
+// Appends the replies of a call of io.systemd.UserDatabase to replies, looked
+// up in the snapshot: one per record, or per membership of GetMemberships.
+// Returns the Varlink error of the call, NULL when it has replies.
+static const char *octopass_userdb_call(struct config *con, struct snapshot *snap, const char *method,
+                                        json_t *params, json_t *replies)
+{
+  json_t *uid_j       = json_object_get(params, "uid");
+  json_t *gid_j       = json_object_get(params, "gid");
+  const char *user    = json_string_value(json_object_get(params, "userName"));
+  const char *group   = json_string_value(json_object_get(params, "groupName"));
+  const char *service = json_string_value(json_object_get(params, "service"));
+  if (service != NULL && strcmp(service, OCTOPASS_USERDB_SERVICE) != 0) {
+    return "io.systemd.UserDatabase.BadService";
+  }
+
+  // Filtered calls look up the indexes, records are built for the matches only.
+  size_t i;
+  int t;
+  if (strcmp(method, "io.systemd.UserDatabase.GetUserRecord") == 0) {
+    json_t *member = NULL;
+    if (json_is_integer(uid_j)) {
+      member = octopass_snapshot_member_by_id(snap, json_integer_value(uid_j) - con->uid_starts);
+      if (member != NULL && user != NULL && member != octopass_snapshot_member_by_name(snap, user)) {
+        member = NULL;
+      }
+    } else if (user != NULL) {
+      member = octopass_snapshot_member_by_name(snap, user);
+    }
+    if (json_is_integer(uid_j) || user != NULL) {
+      json_t *record = octopass_userdb_user(con, member);
+      if (record != NULL) {
+        octopass_userdb_reply(replies, record);
+      }
+    } else {
+      for (i = 0; i < json_array_size(snap->members); i++) {
+        json_t *record = octopass_userdb_user(con, json_array_get(snap->members, i));
+        if (record != NULL) {
+          octopass_userdb_reply(replies, record);
+        }
+      }
+    }
+  } else if (strcmp(method, "io.systemd.UserDatabase.GetGroupRecord") == 0) {
+    if (json_is_integer(gid_j) || group != NULL) {
+      struct team *team = json_is_integer(gid_j) ? octopass_snapshot_team_by_gid(snap, json_integer_value(gid_j))
+                                                 : octopass_snapshot_team_by_name(snap, group);
+      if (team != NULL && (group == NULL || strcmp(group, team->name) == 0)) {
+        octopass_userdb_reply(replies, octopass_userdb_group(team));
+      }
+    } else {
+      for (t = 0; t < snap->teams_count; t++) {
+        octopass_userdb_reply(replies, octopass_userdb_group(&snap->teams[t]));
+      }
+    }
+  } else if (strcmp(method, "io.systemd.UserDatabase.GetMemberships") == 0) {
+    struct team *named = group != NULL ? octopass_snapshot_team_by_name(snap, group) : NULL;
+    if (group != NULL && named == NULL) {
+      return "io.systemd.UserDatabase.NoRecordFound";
+    }
+    int first = named != NULL ? named - snap->teams : 0;
+    int last  = named != NULL ? first + 1 : snap->teams_count;
+    for (t = first; t < last; t++) {
+      struct team *team = &snap->teams[t];
+      const char *login;
+      json_t *value;
+      if (user != NULL) {
+        if (json_object_get(team->logins, user) != NULL) {
+          octopass_userdb_membership(replies, user, team->name);
+        }
+        continue;
+      }
+      json_object_foreach(team->logins, login, value)
+      {
+        octopass_userdb_membership(replies, login, team->name);
+      }
+    }
+  } else {
+    return "org.varlink.service.MethodNotFound";
+  }
+
+  return json_array_size(replies) == 0 ? "io.systemd.UserDatabase.NoRecordFound" : NULL;
+}
+
+// Writes one Varlink message, a JSON object terminated by NUL.
+// OK: 0
+// NG: -1
+static int octopass_varlink_send(int fd, json_t *message)
+{
+  char *text = json_dumps(message, JSON_COMPACT);
+  int status = text != NULL && octopass_write_all(fd, text, strlen(text) + 1) == 0 ? 0 : -1;
+  free(text);
+  json_decref(message);
+  return status;
+}
+
+// Answers one connection of systemd-userdbd (or userdbctl) in Varlink: calls
+// are JSON objects terminated by NUL, each answered by one reply, or by one
+// per record with "continues" when the call sets "more". Lookups are answered
+// from the snapshot, as NSS lookups are, without loading the NSS module.
+// Returns the number of calls answered, or -1 when the connection breaks.
+int octopass_userdb_receive(struct config *con, int fd)
+{
+  struct buffer in = { 0 };
+  char chunk[8192];
+  int calls = 0;
+
+  while (1) {
+    char *end = in.data != NULL ? memchr(in.data, '\0', in.len) : NULL;
+    if (end == NULL) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0 || in.len + n > OCTOPASS_USERDB_MAX_MESSAGE || octopass_buffer_append(&in, chunk, n) != 0) {
+        break;
+      }
+      continue;
+    }
+
+    json_error_t error;
+    json_t *call       = json_loadb(in.data, end - in.data, 0, &error);
+    size_t used        = end - in.data + 1;
+    const char *method = json_string_value(json_object_get(call, "method"));
+    json_t *params     = json_object_get(call, "parameters");
+    bool more          = json_is_true(json_object_get(call, "more"));
+    bool oneway        = json_is_true(json_object_get(call, "oneway"));
+
+    json_t *replies   = json_array();
+    const char *fault = NULL;
+    if (method == NULL) {
+      fault = "org.varlink.service.InvalidParameter";
+    } else if (strncmp(method, "io.systemd.UserDatabase.", strlen("io.systemd.UserDatabase.")) != 0) {
+      fault = "org.varlink.service.MethodNotFound";
+    } else {
+      struct snapshot *snap = octopass_snapshot_acquire(con);
+      fault                 = snap == NULL ? "io.systemd.UserDatabase.ServiceNotAvailable"
+                                           : octopass_userdb_call(con, snap, method, params, replies);
+      octopass_snapshot_unref(snap);
+    }
+    // Enumerating needs "more", as systemd-userdbd asks.
+    if (fault == NULL && !more && json_array_size(replies) > 1) {
+      fault = "org.varlink.service.ExpectedMore";
+    }
+    if (con->syslog) {
+      syslog(LOG_INFO, "%s[L%d] -- method: %s, replies: %lu, error: %s", __func__, __LINE__,
+             method != NULL ? method : "-", (unsigned long)json_array_size(replies), fault != NULL ? fault : "-");
+    }
+
+    int status = 0;
+    if (!oneway && fault != NULL) {
+      json_t *message = json_object();
+      json_object_set_new(message, "error", json_string(fault));
+      json_object_set_new(message, "parameters", json_object());
+      status = octopass_varlink_send(fd, message);
+    } else if (!oneway) {
+      size_t i;
+      for (i = 0; status == 0 && i < json_array_size(replies); i++) {
+        json_t *message = json_object();
+        json_object_set(message, "parameters", json_array_get(replies, i));
+        if (i + 1 < json_array_size(replies)) {
+          json_object_set_new(message, "continues", json_true());
+        }
+        status = octopass_varlink_send(fd, message);
+      }
+    }
+    json_decref(replies);
+    json_decref(call);
+
+    memmove(in.data, in.data + used, in.len - used);
+    in.len -= used;
+    in.data[in.len] = '\0';
+    if (status != 0) {
+      free(in.data);
+      return -1;
+    }
+    calls++;
+  }
+  free(in.data);
+
+  return calls;
+}
+
+// Whether a file of the cache belongs in the bundle of the config: the
+// responses and rendered keys of its token, and its presence filter.
+// Verified tokens, cursors and temporary files never do.
+static bool octopass_bundle_includes(struct config *con, const char *name, uint64_t key_hash)
+{
+  // Responses are named after their shard, "ab/cd/<name>".
+  if (octopass_is_shard(name) && name[2] == '/' && octopass_is_shard(name + 3) && name[5] == '/') {
+    name += 6;
+  }
+  if (name[0] == '.' || strchr(name, '/') != NULL) {
+    return false;
+  }
+
+  char presence[MAXBUF];
+  octopass_presence_file(key_hash, presence, sizeof(presence));
+  if (strcmp(name, strrchr(presence, '/') + 1) == 0) {
+    return true;
+  }
+
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), "-%.6s", con->token);
+  size_t len = strlen(name);
+  return len > strlen(suffix) && strcmp(name + len - strlen(suffix), suffix) == 0;
+}
+
+// When the installed bundle of the config was made.
+void octopass_bundle_stamp_file(uint64_t key_hash, char *file, size_t len)
+{
+  snprintf(file, len, "%s/bundle-%016llx", OCTOPASS_CACHE_DIR, (unsigned long long)key_hash);
+}
+
+// Appends a file of the cache to the payload of a bundle when it belongs there.
+// OK: 0
+// NG: -1
+static int octopass_bundle_append(struct config *con, struct buffer *payload, const char *name, uint64_t key_hash)
+{
+  if (!octopass_bundle_includes(con, name, key_hash)) {
+    return 0;
+  }
+
+  char path[MAXBUF * 4];
+  struct stat statbuf;
+  snprintf(path, sizeof(path), "%s/%s", OCTOPASS_CACHE_DIR, name);
+  if (lstat(path, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+    return 0;
+  }
+
+  size_t len;
+  char *data = octopass_read_data(path, &len);
+  if (data == NULL) {
+    return 0;
+  }
+  char line[MAXBUF * 4];
+  snprintf(line, sizeof(line), "%s %lu\n", name, (unsigned long)len);
+  int status = octopass_buffer_append_str(payload, line);
+  if (status == 0) {
+    status = octopass_buffer_append(payload, data, len);
+  }
+  free(data);
+
+  return status;
+}
+
+// Signs a bundle with the Ed25519 private key of the PEM file key_file, as
+// "ed25519=" and the signature in base64. Only the builder holds it, so that
+// no host can forge a bundle for the others. signature needs
+// OCTOPASS_BUNDLE_SIGNATURE_LEN bytes.
+// OK: 0
+// NG: -1
+int octopass_bundle_sign(const char *key_file, const void *data, size_t len, char *signature)
+{
+  FILE *fp = fopen(key_file, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  // A key anyone else could have read is not used.
+  struct stat statbuf;
+  EVP_PKEY *pkey = NULL;
+  if (fstat(fileno(fp), &statbuf) == 0 && statbuf.st_uid == geteuid() && (statbuf.st_mode & 077) == 0) {
+    pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+  } else {
+    fprintf(stderr, "Untrusted bundle key: %s\n", key_file);
+  }
+  fclose(fp);
+
+  unsigned char sig[64];
+  size_t sig_len  = sizeof(sig);
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  int status      = -1;
+  if (pkey != NULL && ctx != NULL && EVP_PKEY_id(pkey) == EVP_PKEY_ED25519 &&
+      EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+      EVP_DigestSign(ctx, sig, &sig_len, (const unsigned char *)data, len) == 1 && sig_len == sizeof(sig)) {
+    strcpy(signature, "ed25519=");
+    octopass_base64_encode(sig, sig_len, signature + strlen("ed25519="));
+    status = 0;
+  }
+  EVP_MD_CTX_free(ctx);
+  EVP_PKEY_free(pkey);
+
+  return status;
+}
+
+// Checks a signature made by octopass_bundle_sign with the Ed25519 public key
+// of the PEM file key_file.
+// OK: 0
+// NG: -1
+int octopass_bundle_verify(const char *key_file, const void *data, size_t len, const char *signature)
+{
+  unsigned char sig[64 + 3];
+  if (signature == NULL || strncmp(signature, "ed25519=", strlen("ed25519=")) != 0 ||
+      strlen(signature) != OCTOPASS_BUNDLE_SIGNATURE_LEN - 1 ||
+      octopass_base64_decode(signature + strlen("ed25519="), strlen(signature) - strlen("ed25519="), sig) != 64) {
+    return -1;
+  }
+
+  FILE *fp = fopen(key_file, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  EVP_PKEY *pkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+  fclose(fp);
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  int status      = -1;
+  if (pkey != NULL && ctx != NULL && EVP_PKEY_id(pkey) == EVP_PKEY_ED25519 &&
+      EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+      EVP_DigestVerify(ctx, sig, 64, (const unsigned char *)data, len) == 1) {
+    status = 0;
+  }
+  EVP_MD_CTX_free(ctx);
+  EVP_PKEY_free(pkey);
+
+  return status;
+}
+
+// Writes the cache of the config to a bundle: OCTOPASS_BUNDLE_MAGIC, the
+// little endian size of the payload in 8 bytes, and the payload compressed
+// with zlib. The payload is a "octopass-bundle <version> <created> <config>"
+// line followed by "<name> <size>" lines each followed by the file content.
+// The bundle is signed with the private key of BundleKey to file.sig, see octopass_bundle_sign.
+// OK: 0
+// NG: -1
+int octopass_bundle_export(struct config *con, char *file)
+{
+  // Bundles carry the files of the cache directory.
+  if (strlen(con->bundle_key) == 0 || con->backend != &octopass_file_backend) {
+    return -1;
+  }
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  uint64_t key_hash = octopass_hash(key, 0);
+
+  DIR *dir = opendir(OCTOPASS_CACHE_DIR);
+  if (dir == NULL) {
+    return -1;
+  }
+
+  struct buffer payload = { 0 };
+  char line[MAXBUF * 4];
+  snprintf(line, sizeof(line), "octopass-bundle %d %ld %016llx\n", OCTOPASS_BUNDLE_VERSION, (long)time(NULL),
+           (unsigned long long)key_hash);
+  int status = octopass_buffer_append_str(&payload, line);
+
+  struct dirent *ent;
+  while (status == 0 && (ent = readdir(dir)) != NULL) {
+    if (strlen(ent->d_name) != 2 || !octopass_is_shard(ent->d_name)) {
+      status = octopass_bundle_append(con, &payload, ent->d_name, key_hash);
+      continue;
+    }
+
+    char shard[MAXBUF];
+    snprintf(shard, sizeof(shard), "%s/%s", OCTOPASS_CACHE_DIR, ent->d_name);
+    DIR *shard_dir = opendir(shard);
+    struct dirent *sub;
+    while (status == 0 && shard_dir != NULL && (sub = readdir(shard_dir)) != NULL) {
+      char sub_path[MAXBUF * 2];
+      snprintf(sub_path, sizeof(sub_path), "%s/%s", shard, sub->d_name);
+      DIR *sub_dir = strlen(sub->d_name) == 2 && octopass_is_shard(sub->d_name) ? opendir(sub_path) : NULL;
+      struct dirent *file;
+      while (status == 0 && sub_dir != NULL && (file = readdir(sub_dir)) != NULL) {
+        char name[MAXBUF];
+        snprintf(name, sizeof(name), "%s/%s/%s", ent->d_name, sub->d_name, file->d_name);
+        status = octopass_bundle_append(con, &payload, name, key_hash);
+      }
+      if (sub_dir != NULL) {
+        closedir(sub_dir);
+      }
+    }
+    if (shard_dir != NULL) {
+      closedir(shard_dir);
+    }
+  }
+  closedir(dir);
+
+  size_t zlen        = 0;
+  unsigned char *out = status == 0 ? octopass_compress(OCTOPASS_BUNDLE_MAGIC, payload.data, payload.len, 9, &zlen) : NULL;
+  free(payload.data);
+  if (out == NULL) {
+    return -1;
+  }
+
+  char signature[OCTOPASS_BUNDLE_SIGNATURE_LEN + 1];
+  char sig_file[strlen(file) + 8];
+  sprintf(sig_file, "%s.sig", file);
+  status = octopass_bundle_sign(con->bundle_key, out, zlen, signature);
+  if (status == 0) {
+    status = octopass_export_data(file, out, zlen);
+  }
+  if (status == 0) {
+    strcat(signature, "\n");
+    status = octopass_export_data(sig_file, signature, strlen(signature));
+  }
+  free(out);
+
+  return status;
+}
+
+// Verifies a bundle against file.sig and installs its files into the cache,
+// each replaced atomically and dated when the bundle was made, so that they
+// expire as if fetched then. A bundle older than the installed one is
+// refused, so that replaying it cannot bring removed members back.
+// OK: 0
+// NG: -1
+int octopass_bundle_import(struct config *con, char *file)
+{
+  if (con->backend != &octopass_file_backend) {
+    return -1;
+  }
+
+  char sig_file[strlen(file) + 8];
+  sprintf(sig_file, "%s.sig", file);
+
+  size_t len     = 0;
+  size_t sig_len = 0;
+  char *bundle   = octopass_read_data(file, &len);
+  char *sig      = octopass_read_data(sig_file, &sig_len);
+  if (sig != NULL) {
+    sig[strcspn(sig, "\r\n")] = '\0';
+  }
+  if (bundle == NULL || sig == NULL || octopass_bundle_verify(con->bundle_public_key, bundle, len, sig) != 0 ||
+      !octopass_is_compressed(OCTOPASS_BUNDLE_MAGIC, bundle, len)) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "bundle not verified: %s", file);
+    }
+    free(bundle);
+    free(sig);
+    return -1;
+  }
+  free(sig);
+
+  size_t raw    = 0;
+  char *payload = octopass_uncompress(OCTOPASS_BUNDLE_MAGIC, bundle, len, OCTOPASS_BUNDLE_MAX_SIZE, &raw);
+  free(bundle);
+  if (payload == NULL) {
+    return -1;
+  }
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(con, key, sizeof(key));
+  uint64_t key_hash = octopass_hash(key, 0);
+
+  char stamp[MAXBUF];
+  octopass_bundle_stamp_file(key_hash, stamp, sizeof(stamp));
+  long installed = 0;
+  FILE *fp       = fopen(stamp, "r");
+  if (fp != NULL) {
+    if (fscanf(fp, "%ld", &installed) != 1) {
+      installed = 0;
+    }
+    fclose(fp);
+  }
+
+  int version;
+  long created;
+  unsigned long long bundle_hash;
+  char *body = strchr(payload, '\n');
+  if (body == NULL || sscanf(payload, "octopass-bundle %d %ld %llx", &version, &created, &bundle_hash) != 3 ||
+      version != OCTOPASS_BUNDLE_VERSION || bundle_hash != key_hash || created < installed) {
+    if (con->syslog) {
+      syslog(LOG_INFO, "bundle refused, another version, config or older than installed: %s", file);
+    }
+    free(payload);
+    return -1;
+  }
+  body++;
+
+  // Every entry is checked before anything is installed.
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    char *p = body;
+    while (p < payload + raw) {
+      char name[MAXBUF];
+      char *end  = NULL;
+      char *data = memchr(p, '\n', payload + raw - p);
+      char *sp   = data != NULL ? memchr(p, ' ', data - p) : NULL;
+      if (sp != NULL && sp - p < sizeof(name)) {
+        memcpy(name, p, sp - p);
+        name[sp - p] = '\0';
+      }
+      unsigned long size = sp != NULL ? strtoul(sp + 1, &end, 10) : 0;
+      if (sp == NULL || end != data || sp - p >= sizeof(name) ||
+          size > (unsigned long)(payload + raw - data - 1) || !octopass_bundle_includes(con, name, key_hash)) {
+        free(payload);
+        return -1;
+      }
+      data++;
+
+      if (pass == 1) {
+        char path[MAXBUF * 4];
+        snprintf(path, sizeof(path), "%s/%s", OCTOPASS_CACHE_DIR, name);
+        struct timespec times[2] = { { created, 0 }, { created, 0 } };
+        if ((strchr(name, '/') != NULL && octopass_file_cache_shard(path) != 0) ||
+            octopass_export_data(path, data, size) != 0 || utimensat(AT_FDCWD, path, times, 0) != 0) {
+          free(payload);
+          return -1;
+        }
+      }
+      p = data + size;
+    }
+  }
+  free(payload);
+
+  char data[32];
+  snprintf(data, sizeof(data), "%ld\n", created);
+  octopass_export_data(stamp, data, strlen(data));
+
+  // Leftovers of members removed since the previous bundle are purged.
+  struct snapshot *snap = octopass_snapshot_load(con);
+  if (snap != NULL) {
+    octopass_snapshot_publish(snap);
+    octopass_members_diff_apply(con, snap, false);
+    octopass_content_apply(con, snap, OCTOPASS_NSCD_SOCKET);
+    octopass_snapshot_unref(snap);
+  }
+  octopass_generation_bump(con);
+
+  if (con->syslog) {
+    syslog(LOG_INFO, "bundle installed: %s", file);
+  }
+  return 0;
+}
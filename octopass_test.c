@@ -16,7 +16,8 @@
 
 #define OCTOPASS_CONFIG_FILE "test/octopass.conf"
 #include <criterion/criterion.h>
-#include "octopass.c"
+#include <sys/socket.h>
+#include "octopass_server.c"
 
 void setup(void)
 {
@@ -176,6 +177,77 @@ Test(octopass, config_loading__when_use_repository)
   cr_assert_eq(con.shared_users_count, 0);
 }
 
+Test(octopass, config_loading__when_use_teams)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "test/octopass_teams.conf";
+  octopass_config_loading(&con, f);
+
+  cr_assert_str_eq(con.group_name, "yourteam");
+  cr_assert_eq(con.gid, 2000);
+  cr_assert_eq(con.teams_count, 2);
+  cr_assert_str_eq(con.teams[0], "ops");
+  cr_assert_eq(con.teams_gid[0], 3001);
+  cr_assert_str_eq(con.teams[1], "dev");
+  cr_assert_eq(con.teams_gid[1], 3002);
+}
+
+Test(octopass, config_load_cached)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "/tmp/octopass-test-cached.conf";
+  octopass_export_file(f, "Team = \"before\"\nCache = 300\n");
+  cr_assert_eq(octopass_config_load_cached(&con, f), 0);
+  cr_assert_str_eq(con.team, "before");
+  cr_assert_eq(con.cache, 300);
+
+  // Parsed again once the file is replaced.
+  octopass_export_file(f, "Team = \"after\"\n");
+  sleep(1);
+  cr_assert_eq(octopass_config_load_cached(&con, f), 0);
+  cr_assert_str_eq(con.team, "after");
+  cr_assert_eq(con.cache, 500);
+
+  unlink(f);
+  sleep(1);
+  cr_assert_eq(octopass_config_load_cached(&con, f), -1);
+}
+
+Test(octopass, buffer_append)
+{
+  struct buffer buf = { 0 };
+
+  cr_assert_eq(octopass_buffer_append(&buf, "", 0), 0);
+  cr_assert_str_eq(buf.data, "");
+  cr_assert_eq(buf.cap, 256);
+
+  int i;
+  for (i = 0; i < 100; i++) {
+    cr_assert_eq(octopass_buffer_append_str(&buf, "0123456789"), 0);
+  }
+  cr_assert_eq(buf.len, 1000);
+  cr_assert_eq(buf.cap, 1024);
+  cr_assert_eq(strlen(buf.data), 1000);
+  cr_assert_eq(strncmp(buf.data + 990, "0123456789", 10), 0);
+
+  free(buf.data);
+}
+
+Test(octopass, only_keys)
+{
+  const char *keys = octopass_only_keys("[{\"id\": 1, \"key\": \"ssh-rsa AAAA\"}, {\"id\": 2, \"key\": \"ssh-ed25519 BBBB\"}]");
+  cr_assert_str_eq(keys, "ssh-rsa AAAA\nssh-ed25519 BBBB\n");
+  free((char *)keys);
+
+  keys = octopass_only_keys("[]");
+  cr_assert_str_eq(keys, "");
+  free((char *)keys);
+}
+
 Test(octopass, export_file)
 {
   char *f = "/tmp/octopass-export_file_test_1.txt";
@@ -224,6 +296,263 @@ Test(octopass, import_file)
   cr_assert_str_eq(data2, d2);
 }
 
+Test(octopass, key_fingerprint)
+{
+  char fp[OCTOPASS_FINGERPRINT_LEN];
+  char *blob = "AAAAC3NzaC1lZDI1NTE5AAAAIOMqqnkVzrm0SdG6UOoqKLsabgH5C9okWi0dh2l9GKJl";
+
+  cr_assert_eq(octopass_key_fingerprint(blob, strlen(blob), fp), 0);
+  cr_assert_str_eq(fp, "SHA256:+DiY3wvvV6TuJJhbpZisF/zLDA0zPMSvHdkr4UvCOqU");
+
+  cr_assert_eq(octopass_fingerprint_arg(blob, fp), 0);
+  cr_assert_str_eq(fp, "SHA256:+DiY3wvvV6TuJJhbpZisF/zLDA0zPMSvHdkr4UvCOqU");
+  cr_assert_eq(octopass_fingerprint_arg("SHA256:rAEPhvKCV13uwcKqhZn5q5CImpQU5Ps07DEuSk6yKoQ", fp), 0);
+  cr_assert_str_eq(fp, "SHA256:rAEPhvKCV13uwcKqhZn5q5CImpQU5Ps07DEuSk6yKoQ");
+  cr_assert_eq(octopass_fingerprint_arg("not a key", fp), -1);
+}
+
+Test(octopass, fingerprint_lookup)
+{
+  char *index      = NULL;
+  size_t index_len = 0;
+  FILE *fp         = open_memstream(&index, &index_len);
+  octopass_fingerprint_index_append(fp, "linyows",
+                                    "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIOMqqnkVzrm0SdG6UOoqKLsabgH5C9okWi0dh2l9GKJl\n"
+                                    "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIGmVvlW2xMiC0ByuaJh+eFpADrT8wgYZC+3ugyrgLHdP\n");
+  fclose(fp);
+
+  char *out      = NULL;
+  size_t out_len = 0;
+  FILE *in       = fmemopen(index, index_len, "r");
+  FILE *res      = open_memstream(&out, &out_len);
+  cr_assert_eq(octopass_fingerprint_lookup(in, "SHA256:rAEPhvKCV13uwcKqhZn5q5CImpQU5Ps07DEuSk6yKoQ", res), 1);
+  fclose(res);
+  fclose(in);
+  cr_assert_str_eq(out, "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIGmVvlW2xMiC0ByuaJh+eFpADrT8wgYZC+3ugyrgLHdP\n");
+
+  in = fmemopen(index, index_len, "r");
+  cr_assert_eq(octopass_fingerprint_lookup(in, "SHA256:rAEPhvKCV13uwcKqhZn5q5CImpQU5Ps07DEuSk6yKoQQ", stdout), 0);
+  fclose(in);
+
+  free(out);
+  free(index);
+}
+
+Test(octopass, keys_file)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  char file[MAXBUF * 4];
+  octopass_keys_file(&con, "linyows", file, sizeof(file));
+  cr_assert_str_eq(file, "/var/cache/octopass/authorized_keys-linyows-iad87d");
+
+  octopass_keys_file(&con, "../etc/passwd", file, sizeof(file));
+  cr_assert_str_eq(file, "/var/cache/octopass/authorized_keys-..%2Fetc%2Fpasswd-iad87d");
+}
+
+Test(octopass, send_file)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  char *src = "/tmp/octopass-send_file_test_src.txt";
+  char *dst = "/tmp/octopass-send_file_test_dst.txt";
+  octopass_export_file(src, "ssh-rsa AAAA linyows\nssh-ed25519 BBBB linyows\n");
+  cr_assert_eq(octopass_file_is_fresh(&con, src), 1);
+
+  int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  cr_assert_eq(octopass_send_file(src, fd), 0);
+  close(fd);
+  cr_assert_str_eq(octopass_import_file(dst), "ssh-rsa AAAA linyows\nssh-ed25519 BBBB linyows\n");
+
+  unlink(src);
+  cr_assert_eq(octopass_file_is_fresh(&con, src), 0);
+  cr_assert_eq(octopass_send_file(src, fd), -1);
+  unlink(dst);
+}
+
+Test(octopass, export_file__replaces_atomically)
+{
+  char *f = "/tmp/octopass-export_file_test_2.txt";
+  octopass_export_file(f, "OLD\n");
+  octopass_export_file(f, "NEW\n");
+
+  const char *data = octopass_import_file(f);
+  cr_assert_str_eq(data, "NEW\n");
+
+  struct stat statbuf;
+  cr_assert_eq(stat(f, &statbuf), 0);
+  cr_assert_eq(statbuf.st_mode & 0777, 0644);
+}
+
+Test(octopass, snapshot_ref_and_unref)
+{
+  struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+  snap->members         = json_array();
+  snap->refcount        = 1;
+
+  cr_assert_eq(octopass_snapshot_ref(snap), snap);
+  cr_assert_eq(snap->refcount, 2);
+
+  octopass_snapshot_unref(snap);
+  cr_assert_eq(snap->refcount, 1);
+  cr_assert_eq(json_array_size(snap->members), 0);
+
+  octopass_snapshot_unref(snap);
+  octopass_snapshot_unref(NULL);
+}
+
+Test(octopass, snapshot_is_usable)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(&con, key, sizeof(key));
+
+  struct snapshot snap = { 0 };
+  snap.key             = key;
+  snap.loaded_at       = time(NULL);
+  cr_assert_eq(octopass_snapshot_is_usable(&con, &snap, key), 1);
+
+  snap.loaded_at = time(NULL) - con.cache - 1;
+  cr_assert_eq(octopass_snapshot_is_usable(&con, &snap, key), 0);
+
+  snap.loaded_at = time(NULL);
+  snap.key       = "other";
+  cr_assert_eq(octopass_snapshot_is_usable(&con, &snap, key), 0);
+  cr_assert_eq(octopass_snapshot_is_usable(&con, NULL, key), 0);
+
+  snap.key = key;
+  cr_assert_eq(octopass_generation_bump(&con), 0);
+  cr_assert_eq(octopass_snapshot_is_usable(&con, &snap, key), 0);
+  octopass_generation_stat(octopass_hash(key, 0), &snap.generation_ino, &snap.generation_mtime);
+  cr_assert_eq(octopass_snapshot_is_usable(&con, &snap, key), 1);
+
+  char file[MAXBUF];
+  octopass_generation_file(octopass_hash(key, 0), file, sizeof(file));
+  unlink(file);
+}
+
+Test(octopass, snapshot_team_index)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "test/octopass_teams.conf";
+  octopass_config_loading(&con, f);
+
+  json_t *members       = json_pack("[{s:s}, {s:s}]", "login", "linyows", "login", "ken");
+  struct snapshot *snap = octopass_snapshot_new(&con, members);
+  octopass_snapshot_add_team(snap, "ops", 3001, json_pack("[{s:s}]", "login", "ken"));
+
+  cr_assert_eq(snap->teams_count, 2);
+  cr_assert_eq(octopass_snapshot_team_by_name(snap, "yourteam"), &snap->teams[0]);
+  cr_assert_eq(octopass_snapshot_team_by_gid(snap, 2000), &snap->teams[0]);
+  cr_assert_eq(octopass_snapshot_team_by_name(snap, "ops"), &snap->teams[1]);
+  cr_assert_eq(octopass_snapshot_team_by_gid(snap, 3001), &snap->teams[1]);
+  cr_assert_null(octopass_snapshot_team_by_name(snap, "dev"));
+  cr_assert_null(octopass_snapshot_team_by_gid(snap, 3002));
+  cr_assert_not_null(json_object_get(snap->teams[1].logins, "ken"));
+  cr_assert_null(json_object_get(snap->teams[1].logins, "linyows"));
+
+  octopass_snapshot_unref(snap);
+}
+
+Test(octopass, snapshot_member_index)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  json_t *members       = json_pack("[{s:s, s:i}, {s:s, s:i}]", "login", "linyows", "id", 72049, "login", "ken", "id", 3458);
+  struct snapshot *snap = octopass_snapshot_new(&con, members);
+
+  cr_assert_eq(octopass_snapshot_member_by_name(snap, "ken"), json_array_get(members, 1));
+  cr_assert_eq(octopass_snapshot_member_by_id(snap, 72049), json_array_get(members, 0));
+  cr_assert_null(octopass_snapshot_member_by_name(snap, "postgres"));
+  cr_assert_null(octopass_snapshot_member_by_id(snap, 0));
+
+  octopass_snapshot_unref(snap);
+}
+
+Test(octopass, presence_test)
+{
+  json_t *members    = json_pack("[{s:s}, {s:s}]", "login", "linyows", "login", "ken");
+  struct presence *p = octopass_presence_new(1, members);
+
+  cr_assert_eq(p->nbits, 64);
+  cr_assert_eq(p->max_id, -1);
+  cr_assert_eq(octopass_presence_size(p), sizeof(struct presence) + 8);
+  cr_assert_eq(octopass_presence_test(p, "linyows"), 1);
+  cr_assert_eq(octopass_presence_test(p, "ken"), 1);
+  cr_assert_eq(octopass_presence_test(p, "postgres"), 0);
+  cr_assert_eq(octopass_presence_test(p, "nobody"), 0);
+
+  free(p);
+  json_decref(members);
+}
+
+Test(octopass, presence_lookup)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(&con, key, sizeof(key));
+  uint64_t key_hash = octopass_hash(key, 0);
+
+  char file[MAXBUF];
+  octopass_presence_file(key_hash, file, sizeof(file));
+  unlink(file);
+  cr_assert_eq(octopass_presence_lookup(&con, "postgres"), -1);
+
+  json_t *members    = json_pack("[{s:s, s:i}]", "login", "linyows", "id", 72049);
+  struct presence *p = octopass_presence_new(key_hash, members);
+  cr_assert_eq(octopass_export_data(file, p, octopass_presence_size(p)), 0);
+
+  cr_assert_eq(octopass_presence_lookup(&con, "linyows"), 1);
+  cr_assert_eq(octopass_presence_lookup(&con, "postgres"), 0);
+  cr_assert_eq(octopass_presence_lookup_id(&con, 72049), 1);
+  cr_assert_eq(octopass_presence_lookup_id(&con, 72050), 0);
+
+  con.cache = 0;
+  cr_assert_eq(octopass_presence_lookup(&con, "postgres"), -1);
+
+  unlink(file);
+  free(p);
+  json_decref(members);
+}
+
+Test(octopass, snapshot_acquire, .init = setup)
+{
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+
+  struct snapshot *snap1 = octopass_snapshot_acquire(&con);
+  struct snapshot *snap2 = octopass_snapshot_acquire(&con);
+
+  cr_assert_not_null(snap1);
+  cr_assert_eq(snap1, snap2);
+  cr_assert_eq(json_is_array(snap1->members), 1);
+
+  octopass_snapshot_unref(snap1);
+  octopass_snapshot_unref(snap2);
+}
+
 Test(octopass, github_request_without_cache, .init = setup)
 {
   struct config con;
@@ -277,6 +606,255 @@ Test(octopass, github_request_without_cache__when_use_dummy_token, .init = setup
                    res.data);
 }
 
+// A redis-server stand-in with AUTH, GET, GETRANGE, SET (NX, EX) and DEL, closing connections idle for a second.
+struct resp_stub {
+  int sock;
+  char password[MAXBUF];
+  int connections;
+  char keys[8][MAXBUF];
+  char values[8][MAXBUF];
+};
+
+static void *resp_stub_serve(void *arg)
+{
+  struct resp_stub *stub = (struct resp_stub *)arg;
+  int fd;
+  while ((fd = accept(stub->sock, NULL, NULL)) != -1) {
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    stub->connections++;
+    bool authenticated = strlen(stub->password) == 0;
+
+    char req[MAXBUF * 4] = { 0 };
+    while (read(fd, req, sizeof(req) - 1) > 0) {
+      char *argv[8] = { 0 };
+      char *p       = req + 1;
+      int argc      = strtol(p, &p, 10);
+      int i, k;
+      for (i = 0; i < argc && i < 8; i++) {
+        long len = strtol(strchr(p, '$') + 1, &p, 10);
+        argv[i]  = p + 2;
+        p        = argv[i] + len;
+        *p++     = '\0';
+      }
+      for (k = 0; k < 8 && strcmp(stub->keys[k], argv[1]) != 0; k++) {
+      }
+
+      char res[MAXBUF * 2] = "$-1\r\n";
+      if (strcmp(argv[0], "AUTH") == 0) {
+        authenticated = strcmp(argv[1], stub->password) == 0;
+        strcpy(res, authenticated ? "+OK\r\n" : "-WRONGPASS invalid password\r\n");
+      } else if (!authenticated) {
+        strcpy(res, "-NOAUTH Authentication required.\r\n");
+      } else if (strcmp(argv[0], "GET") == 0 && k < 8) {
+        snprintf(res, sizeof(res), "$%lu\r\n%s\r\n", (unsigned long)strlen(stub->values[k]), stub->values[k]);
+      } else if (strcmp(argv[0], "GETRANGE") == 0 && k < 8) {
+        snprintf(res, sizeof(res), "$%d\r\n%.21s\r\n", (int)strnlen(stub->values[k], 21), stub->values[k]);
+      } else if (strcmp(argv[0], "SET") == 0 && !(k < 8 && argc > 3 && strcmp(argv[3], "NX") == 0)) {
+        for (k = 0; k < 8 && strcmp(stub->keys[k], argv[1]) != 0 && strlen(stub->keys[k]) > 0; k++) {
+        }
+        snprintf(stub->keys[k], MAXBUF, "%s", argv[1]);
+        snprintf(stub->values[k], MAXBUF, "%s", argv[2]);
+        strcpy(res, "+OK\r\n");
+      } else if (strcmp(argv[0], "DEL") == 0) {
+        snprintf(res, sizeof(res), ":%d\r\n", k < 8);
+        if (k < 8) {
+          stub->keys[k][0] = '\0';
+        }
+      }
+      write(fd, res, strlen(res));
+      memset(req, 0, sizeof(req));
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+Test(octopass, cache_backend)
+{
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  cr_assert_eq(con.backend, &octopass_file_backend);
+  cr_assert_null(octopass_cache_backend("memcached"));
+
+  struct resp_stub stub;
+  memset(&stub, 0, sizeof(stub));
+  snprintf(stub.password, sizeof(stub.password), "octopass-test-password");
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  stub.sock            = socket(AF_INET, SOCK_STREAM, 0);
+  cr_assert_eq(bind(stub.sock, (struct sockaddr *)&addr, sizeof(addr)), 0);
+  cr_assert_eq(listen(stub.sock, 8), 0);
+  getsockname(stub.sock, (struct sockaddr *)&addr, &addr_len);
+  snprintf(con.cache_server, sizeof(con.cache_server), "127.0.0.1:%d", ntohs(addr.sin_port));
+  pthread_t thread;
+  pthread_create(&thread, NULL, resp_stub_serve, &stub);
+
+  // Refused without the password, then authenticated once for all the commands of a connection.
+  con.backend = &octopass_redis_backend;
+  cr_assert_eq(con.backend->put(&con, "octopass-test-auth", "[]", 60), -1);
+  snprintf(con.cache_password, sizeof(con.cache_password), "%s", stub.password);
+  cr_assert_eq(con.backend->put(&con, "octopass-test-auth", "[]", 60), 0);
+  cr_assert_str_eq(con.backend->get(&con, "octopass-test-auth"), "[]");
+  cr_assert_eq(con.backend->remove(&con, "octopass-test-auth"), 0);
+  cr_assert_eq(stub.connections, 2);
+
+  // Connected again once the server has closed the idle connection.
+  sleep(2);
+  cr_assert_null(con.backend->get(&con, "octopass-test-auth"));
+  cr_assert_eq(stub.connections, 3);
+
+  const struct cache_backend *backends[] = { &octopass_file_backend, &octopass_shm_backend, &octopass_redis_backend };
+  char *key = "octopass-test-backend";
+  size_t i;
+  for (i = 0; i < 3; i++) {
+    con.backend = backends[i];
+    con.backend->remove(&con, key);
+    cr_assert_eq(con.backend->age(&con, key), -1, "%s", con.backend->name);
+    cr_assert_null(con.backend->get(&con, key));
+
+    cr_assert_eq(con.backend->put(&con, key, "[\"linyows\"]", 60), 0, "%s", con.backend->name);
+    cr_assert_leq(con.backend->age(&con, key), 1);
+    cr_assert_str_eq(con.backend->get(&con, key), "[\"linyows\"]");
+
+    cr_assert_eq(con.backend->lock(&con, key, 60), 0);
+    cr_assert_eq(con.backend->lock(&con, key, 60), 1);
+    con.backend->unlock(&con, key);
+    cr_assert_eq(con.backend->lock(&con, key, 60), 0);
+    con.backend->unlock(&con, key);
+
+    cr_assert_eq(con.backend->remove(&con, key), 0);
+    cr_assert_eq(con.backend->age(&con, key), -1);
+  }
+
+  // Anyone could have written a world writable shm directory, it is not read.
+  con.backend = &octopass_shm_backend;
+  cr_assert_eq(con.backend->put(&con, key, "[]", 60), 0);
+  chmod(OCTOPASS_SHM_CACHE_DIR, 0777);
+  cr_assert_null(con.backend->get(&con, key));
+  chmod(OCTOPASS_SHM_CACHE_DIR, 0755);
+  con.backend->remove(&con, key);
+
+  shutdown(stub.sock, SHUT_RDWR);
+  close(stub.sock);
+  pthread_join(thread, NULL);
+}
+
+Test(octopass, cache_shm_trust)
+{
+  if (geteuid() != 0) {
+    cr_skip_test("Needs root to make the directory of another user");
+  }
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  con.backend = &octopass_shm_backend;
+
+  // Made by another user before root, as by an NSS lookup of an unprivileged process.
+  char aside[MAXBUF];
+  snprintf(aside, sizeof(aside), "%s.test-%d", OCTOPASS_SHM_CACHE_DIR, getpid());
+  rename(OCTOPASS_SHM_CACHE_DIR, aside);
+  cr_assert_eq(mkdir(OCTOPASS_SHM_CACHE_DIR, 0755), 0);
+  cr_assert_eq(chown(OCTOPASS_SHM_CACHE_DIR, 65534, 65534), 0);
+  cr_assert_null(con.backend->get(&con, "octopass-test-trust"));
+
+  cr_assert_eq(con.backend->put(&con, "octopass-test-trust", "[]", 60), 0);
+  struct stat st;
+  cr_assert_eq(lstat(OCTOPASS_SHM_CACHE_DIR, &st), 0);
+  cr_assert_eq(st.st_uid, 0);
+  cr_assert_str_eq(con.backend->get(&con, "octopass-test-trust"), "[]");
+  con.backend->remove(&con, "octopass-test-trust");
+
+  char cmd[MAXBUF * 3];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s.untrusted-*; rm -rf %s; mv %s %s", OCTOPASS_SHM_CACHE_DIR, OCTOPASS_SHM_CACHE_DIR,
+           aside, OCTOPASS_SHM_CACHE_DIR);
+  system(cmd);
+}
+
+Test(octopass, cache_gc)
+{
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  con.backend           = &octopass_shm_backend;
+  con.cache_max_entries = 0;
+  cr_assert_geq(con.backend->gc(&con), 0);
+
+  // Least recently used first.
+  char *keys[] = { "octopass-test-gc1", "octopass-test-gc2", "octopass-test-gc3" };
+  int i;
+  for (i = 0; i < 3; i++) {
+    cr_assert_eq(con.backend->put(&con, keys[i], "[]", 60), 0);
+    char file[MAXBUF];
+    octopass_file_cache_path(&con, keys[i], "", file, sizeof(file));
+    struct timespec times[2] = { { 1000 + i, 0 }, { 0, UTIME_OMIT } };
+    cr_assert_eq(utimensat(AT_FDCWD, file, times, 0), 0);
+  }
+  octopass_export_file(OCTOPASS_SHM_CACHE_DIR "/https%3A%2F%2Fapi.github.com%2Fuser-iad87d", "{}");
+
+  con.cache_max_entries = 2;
+  cr_assert_eq(con.backend->gc(&con), 2);
+  cr_assert_eq(access(OCTOPASS_SHM_CACHE_DIR "/https%3A%2F%2Fapi.github.com%2Fuser-iad87d", F_OK), -1);
+  cr_assert_eq(con.backend->age(&con, keys[0]), -1);
+  cr_assert_neq(con.backend->age(&con, keys[1]), -1);
+
+  // Reading marks an entry used.
+  cr_assert_not_null(con.backend->get(&con, keys[1]));
+  con.cache_max_size = 2;
+  cr_assert_eq(con.backend->gc(&con), 1);
+  cr_assert_eq(con.backend->age(&con, keys[2]), -1);
+  cr_assert_neq(con.backend->age(&con, keys[1]), -1);
+  con.backend->remove(&con, keys[1]);
+}
+
+Test(octopass, cache_compress)
+{
+  char *json = "[{\"login\":\"linyows\",\"id\":72049},{\"login\":\"linyows\",\"id\":72049}]";
+  size_t zlen;
+  size_t len;
+  unsigned char *z = octopass_compress(OCTOPASS_CACHE_MAGIC, json, strlen(json), 9, &zlen);
+  cr_assert_not_null(z);
+  char *raw = octopass_uncompress(OCTOPASS_CACHE_MAGIC, (char *)z, zlen, MAXBUF, &len);
+  cr_assert_str_eq(raw, json);
+  cr_assert_eq(len, strlen(json));
+  free(raw);
+  cr_assert_null(octopass_uncompress(OCTOPASS_BUNDLE_MAGIC, (char *)z, zlen, MAXBUF, &len));
+  cr_assert_null(octopass_uncompress(OCTOPASS_CACHE_MAGIC, (char *)z, zlen, 8, &len));
+  cr_assert_null(octopass_uncompress(OCTOPASS_CACHE_MAGIC, (char *)z, zlen - 1, MAXBUF, &len));
+  free(z);
+
+  char *gz = octopass_gzip(json, strlen(json), &zlen);
+  cr_assert_not_null(gz);
+  cr_assert_eq((unsigned char)gz[0], 0x1f);
+  cr_assert_eq((unsigned char)gz[1], 0x8b);
+  free(gz);
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  con.backend = &octopass_shm_backend;
+  char *key   = "octopass-test-compress";
+  cr_assert_eq(con.backend->put(&con, key, json, 60), 0);
+
+  // Responses stored before CacheCompress keep being read, and the other way round.
+  con.cache_compress = true;
+  raw                = con.backend->get(&con, key);
+  cr_assert_str_eq(raw, json);
+  free(raw);
+  cr_assert_eq(con.backend->put(&con, key, json, 60), 0);
+  char file[MAXBUF];
+  octopass_file_cache_path(&con, key, "", file, sizeof(file));
+  char *data = octopass_read_data(file, &len);
+  cr_assert(octopass_is_compressed(OCTOPASS_CACHE_MAGIC, data, len));
+  free(data);
+  con.cache_compress = false;
+  raw                = con.backend->get(&con, key);
+  cr_assert_str_eq(raw, json);
+  free(raw);
+  con.backend->remove(&con, key);
+}
+
 Test(octopass, team_id, .init = setup)
 {
   struct config con;
@@ -451,6 +1029,736 @@ Test(octopass, authentication_with_token__when_wrong_token, .init = setup)
   cr_assert_eq(status, 1);
 }
 
+Test(octopass, is_member, .init = setup)
+{
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+
+  // Nothing is loaded for it, the member list is read only after the token is verified.
+  cr_assert_eq(octopass_is_member(&con, "linyows"), -1);
+  cr_assert_eq(octopass_is_listed_member(&con, "linyows"), 1);
+  cr_assert_eq(octopass_is_listed_member(&con, "postgres"), 0);
+
+  struct snapshot *snap = octopass_snapshot_acquire(&con);
+  cr_assert_not_null(snap);
+  octopass_snapshot_unref(snap);
+  cr_assert_eq(octopass_is_member(&con, "linyows"), 1);
+  cr_assert_eq(octopass_is_member(&con, "postgres"), 0);
+
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+  strcpy(con.team, "unreachable");
+  cr_assert_eq(octopass_is_member(&con, "linyows"), -1);
+  cr_assert_eq(octopass_is_listed_member(&con, "linyows"), -1);
+}
+
+// Caches the teams of the organization and the members of Team for an unreachable endpoint.
+static void cache_members(struct config *con, const char *members)
+{
+  char url[MAXBUF * 2];
+  char key[MAXBUF * 8];
+  snprintf(url, sizeof(url), "%sorgs/%s/teams?per_page=100", con->endpoint, con->organization);
+  octopass_cache_key(con, url, key, sizeof(key));
+  char teams[MAXBUF];
+  snprintf(teams, sizeof(teams), "[{\"name\":\"%s\",\"id\":1}]", con->team);
+  cr_assert_eq(con->backend->put(con, key, teams, 60), 0);
+
+  snprintf(url, sizeof(url), "%steams/1/members?per_page=100", con->endpoint);
+  octopass_cache_key(con, url, key, sizeof(key));
+  cr_assert_eq(con->backend->put(con, key, members, 60), 0);
+}
+
+Test(octopass, authentication_with_token__when_cached)
+{
+  clearenv();
+
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+
+  char *user  = "cacheduser";
+  char *token = "cachedtokencachedtokencachedtokencachedt";
+  octopass_token_cache_remove(user);
+  cr_assert_eq(octopass_token_cache_check(user, token), -1);
+  cr_assert_eq(octopass_autentication_with_token(&con, user, token), 1);
+
+  cr_assert_eq(octopass_token_cache_store(user, token), 0);
+  char file[MAXBUF * 4];
+  octopass_token_file(user, file, sizeof(file));
+  struct stat statbuf;
+  cr_assert_eq(stat(file, &statbuf), 0);
+  cr_assert_eq(statbuf.st_mode & 0777, 0600);
+  cr_assert_str_neq(octopass_import_file(file), token);
+
+  cr_assert_geq(octopass_token_cache_check(user, token), 0);
+  cr_assert_eq(octopass_token_cache_check(user, "dummydummydummydummydummydummydummydummy"), -1);
+  cr_assert_eq(octopass_autentication_with_token(&con, user, token), 0);
+  cr_assert_eq(octopass_autentication_with_token(&con, user, "dummydummydummydummydummydummydummydummy"), 1);
+
+  // Past the cache period it is verified again in place, and kept while GitHub cannot be reached
+  // as long as the member list still has the user.
+  cache_members(&con, "[{\"login\":\"cacheduser\",\"id\":1}]");
+  char *entry = (char *)octopass_import_file(file);
+  char aged[MAXBUF];
+  snprintf(aged, sizeof(aged), "%.*s %ld\n", (int)strcspn(entry, " "), entry, (long)time(NULL) - con.cache - 10);
+  octopass_export_data_with_mode(file, aged, strlen(aged), 0600);
+  cr_assert_gt(octopass_token_cache_check(user, token), con.cache);
+  cr_assert_eq(octopass_autentication_with_token(&con, user, token), 0);
+  cr_assert_gt(octopass_token_cache_check(user, token), con.cache);
+
+  octopass_token_cache_remove(user);
+}
+
+Test(octopass, authentication_with_token__when_cached_but_removed)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+  cache_members(&con, "[{\"login\":\"linyows\",\"id\":1}]");
+
+  // Verified before the user left the team, aged past the cache period.
+  char *user  = "formeruser";
+  char *token = "formertokenformertokenformertokenformert";
+  cr_assert_eq(octopass_token_cache_store(user, token), 0);
+  char file[MAXBUF * 4];
+  octopass_token_file(user, file, sizeof(file));
+  char *entry = (char *)octopass_import_file(file);
+  char aged[MAXBUF];
+  snprintf(aged, sizeof(aged), "%.*s %ld\n", (int)strcspn(entry, " "), entry, (long)time(NULL) - con.cache - 10);
+  octopass_export_data_with_mode(file, aged, strlen(aged), 0600);
+  cr_assert_gt(octopass_token_cache_check(user, token), con.cache);
+
+  cr_assert_eq(octopass_is_member(&con, user), -1);
+  cr_assert_eq(octopass_autentication_with_token(&con, user, token), 1);
+  cr_assert_eq(octopass_token_cache_check(user, token), -1);
+}
+
+Test(octopass, webhook_verify)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  char *body = "Hello, World!";
+  char *sig  = "sha256=757107ea0eb2509fc211221cce984b8a37570b6d7586c22c46f4379c8b043e17";
+  char *bad  = "sha256=857107ea0eb2509fc211221cce984b8a37570b6d7586c22c46f4379c8b043e17";
+
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body), sig), -1);
+
+  // The example of the GitHub documentation.
+  strcpy(con.webhook_secret, "It's a Secret to Everybody");
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body), sig), 0);
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body) - 1, sig), -1);
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body), bad), -1);
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body), "sha1=757107ea0eb2509fc211221cce984b8a37570b6d"), -1);
+  cr_assert_eq(octopass_webhook_verify(&con, body, strlen(body), NULL), -1);
+}
+
+// Replays a delivery over a socket pair and returns the status responded.
+static int replay_webhook(struct config *con, const char *event, const char *body, const char *signature)
+{
+  char req[8192];
+  snprintf(req, sizeof(req),
+           "POST /webhook HTTP/1.1\r\nHost: localhost\r\nX-GitHub-Event: %s\r\nX-Hub-Signature-256: %s\r\n"
+           "Content-Type: application/json\r\nContent-Length: %lu\r\n\r\n%s",
+           event, signature, (unsigned long)strlen(body), body);
+
+  int fds[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  cr_assert_eq(write(fds[0], req, strlen(req)), (ssize_t)strlen(req));
+
+  int code = octopass_webhook_receive(con, fds[1]);
+  char res[MAXBUF] = { 0 };
+  cr_assert_gt(read(fds[0], res, sizeof(res) - 1), 0);
+  char status[16];
+  snprintf(status, sizeof(status), " %d ", code);
+  cr_assert(strstr(res, status) != NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  return code;
+}
+
+static void sign_webhook(struct config *con, const char *body, char *signature)
+{
+  unsigned char mac[32];
+  HMAC(EVP_sha256(), con->webhook_secret, strlen(con->webhook_secret), (const unsigned char *)body, strlen(body), mac,
+       NULL);
+  strcpy(signature, "sha256=");
+  int i;
+  for (i = 0; i < 32; i++) {
+    sprintf(signature + 7 + i * 2, "%02x", mac[i]);
+  }
+}
+
+Test(octopass, webhook_receive)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.webhook_secret, "webhooksecret");
+
+  char signature[80];
+  char *body = "{\"zen\":\"Keep it logically awesome.\",\"hook_id\":1}";
+  sign_webhook(&con, body, signature);
+  cr_assert_eq(replay_webhook(&con, "ping", body, signature), 204);
+  cr_assert_eq(replay_webhook(&con, "ping", body, "sha256=0000"), 401);
+
+  // Membership of another team is not applied.
+  body = "{\"action\":\"removed\",\"scope\":\"team\",\"member\":{\"login\":\"ken\"},"
+         "\"team\":{\"name\":\"otherteam\",\"id\":1},\"organization\":{\"login\":\"yourorganization\"}}";
+  sign_webhook(&con, body, signature);
+  cr_assert_eq(octopass_webhook_handle(&con, "membership", body), 1);
+  cr_assert_eq(replay_webhook(&con, "membership", body, signature), 204);
+
+  body = "{\"action\":";
+  sign_webhook(&con, body, signature);
+  cr_assert_eq(octopass_webhook_handle(&con, "membership", body), -2);
+  cr_assert_eq(replay_webhook(&con, "membership", body, signature), 400);
+}
+
+Test(octopass, webhook_handle, .init = setup)
+{
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.webhook_secret, "webhooksecret");
+
+  // Rendered before the member was removed.
+  char *user = "removedmember";
+  char file[MAXBUF * 4];
+  octopass_keys_file(&con, user, file, sizeof(file));
+  octopass_export_file(file, "ssh-ed25519 AAAA removedmember\n");
+  cr_assert_eq(octopass_token_cache_store(user, "removedtokenremovedtokenremovedtokenremo"), 0);
+
+  struct snapshot *before = octopass_snapshot_acquire(&con);
+  cr_assert_not_null(before);
+
+  char body[MAXBUF];
+  snprintf(body, sizeof(body),
+           "{\"action\":\"removed\",\"scope\":\"team\",\"member\":{\"login\":\"%s\"},"
+           "\"team\":{\"name\":\"%s\",\"id\":1},\"organization\":{\"login\":\"%s\"}}",
+           user, con.team, con.organization);
+  char signature[80];
+  sign_webhook(&con, body, signature);
+  cr_assert_eq(replay_webhook(&con, "membership", body, signature), 204);
+
+  cr_assert_eq(access(file, F_OK), -1);
+  cr_assert_eq(octopass_token_cache_check(user, "removedtokenremovedtokenremovedtokenremo"), -1);
+
+  char key[MAXBUF * 8];
+  octopass_snapshot_key(&con, key, sizeof(key));
+  cr_assert_eq(octopass_snapshot_is_usable(&con, before, key), 0);
+  octopass_snapshot_unref(before);
+
+  struct snapshot *after = octopass_snapshot_acquire(&con);
+  cr_assert_eq(octopass_snapshot_is_usable(&con, after, key), 1);
+  octopass_snapshot_unref(after);
+}
+
+Test(octopass, members_diff)
+{
+  const char *before[] = { "ken", "linyows", "ryu" };
+  const char *after[]  = { "chun", "ken", "ryu", "zangief" };
+  json_t *added        = json_array();
+  json_t *removed      = json_array();
+
+  octopass_members_diff(before, 3, after, 4, added, removed);
+  cr_assert_eq(json_array_size(added), 2);
+  cr_assert_str_eq(json_string_value(json_array_get(added, 0)), "chun");
+  cr_assert_str_eq(json_string_value(json_array_get(added, 1)), "zangief");
+  cr_assert_eq(json_array_size(removed), 1);
+  cr_assert_str_eq(json_string_value(json_array_get(removed, 0)), "linyows");
+
+  json_array_clear(added);
+  json_array_clear(removed);
+  octopass_members_diff(before, 3, NULL, 0, added, removed);
+  cr_assert_eq(json_array_size(added), 0);
+  cr_assert_eq(json_array_size(removed), 3);
+
+  json_decref(added);
+  json_decref(removed);
+}
+
+Test(octopass, members_diff_apply)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  char file[MAXBUF];
+  octopass_members_list_file(&con, file, sizeof(file));
+  unlink(file);
+
+  json_error_t error;
+  struct snapshot *snap = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"ryu\",\"id\":3},{\"login\":\"linyows\",\"id\":1}]", 0, &error));
+  cr_assert_eq(octopass_members_diff_apply(&con, snap, false), 0);
+  cr_assert_str_eq(octopass_import_file(file), "linyows\nryu\n");
+  octopass_snapshot_unref(snap);
+
+  char keys[MAXBUF * 4];
+  octopass_keys_file(&con, "ryu", keys, sizeof(keys));
+  octopass_export_file(keys, "ssh-ed25519 AAAA ryu\n");
+
+  snap = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ken\",\"id\":2}]", 0, &error));
+  cr_assert_eq(octopass_members_diff_apply(&con, snap, false), 2);
+  cr_assert_str_eq(octopass_import_file(file), "ken\nlinyows\n");
+  cr_assert_eq(access(keys, F_OK), -1);
+
+  const char *journal = octopass_import_file(OCTOPASS_JOURNAL_FILE);
+  cr_assert(strstr(journal, "removed yourteam ryu\n") != NULL);
+  cr_assert(strstr(journal, "added yourteam ken\n") != NULL);
+
+  cr_assert_eq(octopass_members_diff_apply(&con, snap, false), 0);
+  octopass_snapshot_unref(snap);
+  unlink(file);
+}
+
+struct nscd_stub {
+  int sock;
+  char dbs[MAXBUF];
+};
+
+static void *nscd_stub_serve(void *arg)
+{
+  struct nscd_stub *stub = (struct nscd_stub *)arg;
+  int fd;
+  while ((fd = accept(stub->sock, NULL, NULL)) != -1) {
+    char req[MAXBUF] = { 0 };
+    int32_t res      = -1;
+    ssize_t n        = read(fd, req, sizeof(req) - 1);
+    int32_t *head    = (int32_t *)req;
+    if (n > 12 && head[0] == OCTOPASS_NSCD_VERSION && head[1] == OCTOPASS_NSCD_INVALIDATE) {
+      strcat(stub->dbs, req + 12);
+      strcat(stub->dbs, " ");
+      res = 0;
+    }
+    write(fd, &res, sizeof(res));
+    close(fd);
+  }
+  return NULL;
+}
+
+Test(octopass, content_apply)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  char file[MAXBUF];
+  octopass_content_file(&con, file, sizeof(file));
+  unlink(file);
+
+  struct nscd_stub stub;
+  memset(&stub, 0, sizeof(stub));
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/octopass-test-nscd-%d", getpid());
+  unlink(addr.sun_path);
+  stub.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  cr_assert_eq(bind(stub.sock, (struct sockaddr *)&addr, sizeof(addr)), 0);
+  cr_assert_eq(listen(stub.sock, 8), 0);
+  pthread_t thread;
+  pthread_create(&thread, NULL, nscd_stub_serve, &stub);
+
+  json_error_t error;
+  struct snapshot *snap = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"ryu\",\"id\":3},{\"login\":\"linyows\",\"id\":1}]", 0, &error));
+  uint64_t hash = octopass_content_hash(snap);
+  cr_assert_eq(octopass_content_apply(&con, snap, addr.sun_path), 1);
+  cr_assert_str_eq(stub.dbs, "passwd group ");
+  octopass_snapshot_unref(snap);
+
+  // The same members in another order are no change, nscd is left alone.
+  stub.dbs[0] = '\0';
+  snap        = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ryu\",\"id\":3}]", 0, &error));
+  cr_assert_eq(octopass_content_hash(snap), hash);
+  cr_assert_eq(octopass_content_apply(&con, snap, addr.sun_path), 0);
+  cr_assert_str_eq(stub.dbs, "");
+  octopass_snapshot_unref(snap);
+
+  snap = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ryu\",\"id\":4}]", 0, &error));
+  cr_assert_neq(octopass_content_hash(snap), hash);
+  cr_assert_eq(octopass_content_apply(&con, snap, addr.sun_path), 1);
+  cr_assert_str_eq(stub.dbs, "passwd group ");
+  octopass_snapshot_unref(snap);
+
+  cr_assert_eq(octopass_nscd_invalidate("/tmp/octopass-test-nscd-none", "passwd"), -1);
+  shutdown(stub.sock, SHUT_RDWR);
+  close(stub.sock);
+  pthread_join(thread, NULL);
+  unlink(addr.sun_path);
+  unlink(file);
+}
+
+Test(octopass, cursor)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  cr_assert(con.incremental == false);
+  cr_assert_eq(con.resync, OCTOPASS_RESYNC);
+
+  char file[MAXBUF];
+  octopass_cursor_file(&con, file, sizeof(file));
+  unlink(file);
+
+  long long cursor;
+  long resynced_at;
+  cr_assert_eq(octopass_cursor_load(&con, &cursor, &resynced_at), -1);
+  cr_assert_eq(octopass_refresh_incremental(&con), 1);
+
+  cr_assert_eq(octopass_cursor_store(&con, 1500000000123LL, 1500000000), 0);
+  cr_assert_eq(octopass_cursor_load(&con, &cursor, &resynced_at), 0);
+  cr_assert_eq(cursor, 1500000000123LL);
+  cr_assert_eq(resynced_at, 1500000000);
+
+  // Fetched everything too long ago.
+  cr_assert_eq(octopass_refresh_incremental(&con), 1);
+  unlink(file);
+}
+
+Test(octopass, audit_log_apply)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+
+  json_error_t error;
+  struct cached_team teams[2];
+  memset(teams, 0, sizeof(teams));
+  strcpy(teams[0].slug, "yourorganization/yourteam");
+  strcpy(teams[1].slug, "yourorganization/ops");
+  teams[0].members = json_loads("[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ken\",\"id\":2}]", 0, &error);
+  teams[1].members = json_loads("[{\"login\":\"ken\",\"id\":2}]", 0, &error);
+
+  json_t *entries = json_loads(
+      "[{\"@timestamp\":900,\"action\":\"team.remove_member\",\"user\":\"linyows\",\"team\":\"yourorganization/yourteam\"},"
+      "{\"@timestamp\":1000,\"action\":\"team.add_member\",\"user\":\"ryu\",\"user_id\":3,\"team\":\"yourorganization/yourteam\"},"
+      "{\"@timestamp\":1001,\"action\":\"team.add_member\",\"user\":\"ken\",\"user_id\":2,\"team\":\"yourorganization/yourteam\"},"
+      "{\"@timestamp\":1002,\"action\":\"repo.create\",\"repo\":\"yourorganization/new\"},"
+      "{\"@timestamp\":1003,\"action\":\"team.add_member\",\"user\":\"chun\",\"user_id\":4,\"team\":\"otherorg/ops\"},"
+      "{\"@timestamp\":1004,\"action\":\"org.remove_member\",\"user\":\"ken\"}]",
+      0, &error);
+
+  long long last = 0;
+  cr_assert_eq(octopass_audit_log_apply(&con, entries, 1000, teams, 2, &last), 3);
+  cr_assert_eq(last, 1004);
+
+  char *members = json_dumps(teams[0].members, JSON_COMPACT);
+  cr_assert_str_eq(members, "[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ryu\",\"id\":3}]");
+  free(members);
+  cr_assert_eq(json_array_size(teams[1].members), 0);
+
+  // A member that cannot be fetched fails the whole refresh.
+  json_t *unknown = json_loads(
+      "[{\"@timestamp\":1005,\"action\":\"team.add_member\",\"user\":\"guile\",\"team\":\"yourorganization/ops\"}]", 0,
+      &error);
+  cr_assert_eq(octopass_audit_log_apply(&con, unknown, 1000, teams, 2, &last), -1);
+
+  json_decref(unknown);
+  json_decref(entries);
+  json_decref(teams[0].members);
+  json_decref(teams[1].members);
+}
+
+// Writes a new Ed25519 key pair to private_file and public_file, as openssl genpkey does.
+static void bundle_keygen(const char *private_file, const char *public_file)
+{
+  EVP_PKEY *pkey     = NULL;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+  cr_assert_eq(EVP_PKEY_keygen_init(pctx), 1);
+  cr_assert_eq(EVP_PKEY_keygen(pctx, &pkey), 1);
+  EVP_PKEY_CTX_free(pctx);
+
+  FILE *fp = fopen(private_file, "w");
+  fchmod(fileno(fp), 0600);
+  cr_assert_eq(PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL), 1);
+  fclose(fp);
+  fp = fopen(public_file, "w");
+  cr_assert_eq(PEM_write_PUBKEY(fp, pkey), 1);
+  fclose(fp);
+  EVP_PKEY_free(pkey);
+}
+
+Test(octopass, bundle)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+  char *bundle = "/tmp/octopass-test.bundle";
+  cr_assert_eq(octopass_bundle_export(&con, bundle), -1);
+  bundle_keygen("/tmp/octopass-test-bundle.pem", "/tmp/octopass-test-bundle.pub");
+  bundle_keygen("/tmp/octopass-test-other.pem", "/tmp/octopass-test-other.pub");
+  strcpy(con.bundle_key, "/tmp/octopass-test-bundle.pem");
+  strcpy(con.bundle_public_key, "/tmp/octopass-test-bundle.pub");
+
+  char key[MAXBUF * 8];
+  char stamp[MAXBUF];
+  octopass_snapshot_key(&con, key, sizeof(key));
+  octopass_bundle_stamp_file(octopass_hash(key, 0), stamp, sizeof(stamp));
+  unlink(stamp);
+
+  char file[MAXBUF * 4];
+  octopass_keys_file(&con, "bundleuser", file, sizeof(file));
+  octopass_export_file(file, "ssh-ed25519 AAAA bundleuser\n");
+  cr_assert_eq(octopass_bundle_export(&con, bundle), 0);
+  cr_assert_eq(access("/tmp/octopass-test.bundle.sig", R_OK), 0);
+
+  unlink(file);
+  cr_assert_eq(octopass_bundle_import(&con, bundle), 0);
+  cr_assert_str_eq(octopass_import_file(file), "ssh-ed25519 AAAA bundleuser\n");
+
+  // Not for hosts with another key or config.
+  strcpy(con.bundle_public_key, "/tmp/octopass-test-other.pub");
+  cr_assert_eq(octopass_bundle_import(&con, bundle), -1);
+  strcpy(con.bundle_public_key, "/tmp/octopass-test-bundle.pub");
+  strcpy(con.team, "otherteam");
+  cr_assert_eq(octopass_bundle_import(&con, bundle), -1);
+  octopass_config_loading(&con, "test/octopass.conf");
+  strcpy(con.endpoint, "http://127.0.0.1:1/");
+  strcpy(con.bundle_key, "/tmp/octopass-test-bundle.pem");
+  strcpy(con.bundle_public_key, "/tmp/octopass-test-bundle.pub");
+
+  // Hosts hold the public key only, it cannot sign.
+  char signature[OCTOPASS_BUNDLE_SIGNATURE_LEN + 1];
+  cr_assert_eq(octopass_bundle_sign("/tmp/octopass-test-bundle.pub", "x", 1, signature), -1);
+  chmod("/tmp/octopass-test-other.pem", 0644);
+  cr_assert_eq(octopass_bundle_sign("/tmp/octopass-test-other.pem", "x", 1, signature), -1);
+
+  // Older than the installed one.
+  char data[32];
+  snprintf(data, sizeof(data), "%ld\n", (long)time(NULL) + 60);
+  octopass_export_file(stamp, data);
+  cr_assert_eq(octopass_bundle_import(&con, bundle), -1);
+  unlink(stamp);
+
+  size_t len;
+  char *raw = octopass_read_data(bundle, &len);
+  raw[len - 1] ^= 1;
+  octopass_export_data(bundle, raw, len);
+  cr_assert_eq(octopass_bundle_import(&con, bundle), -1);
+
+  free(raw);
+  unlink(file);
+  unlink(bundle);
+  unlink("/tmp/octopass-test.bundle.sig");
+  unlink("/tmp/octopass-test-bundle.pem");
+  unlink("/tmp/octopass-test-bundle.pub");
+  unlink("/tmp/octopass-test-other.pem");
+  unlink("/tmp/octopass-test-other.pub");
+}
+
+Test(octopass, proxy_allowed)
+{
+  cr_assert(octopass_proxy_allowed("orgs/yourorganization/teams?per_page=100"));
+  cr_assert(octopass_proxy_allowed("teams/2244789/members?per_page=100"));
+  cr_assert(octopass_proxy_allowed("repos/linyows/octopass/collaborators?per_page=100"));
+  cr_assert(octopass_proxy_allowed("users/linyows/keys?per_page=100"));
+  cr_assert(octopass_proxy_allowed("user"));
+
+  cr_assert_not(octopass_proxy_allowed("orgs/yourorganization/audit-log"));
+  cr_assert_not(octopass_proxy_allowed("teams/2244789/members/linyows"));
+  cr_assert_not(octopass_proxy_allowed("users/../user"));
+  cr_assert_not(octopass_proxy_allowed("users/linyows/keys#x"));
+  cr_assert_not(octopass_proxy_allowed("user/repos"));
+}
+
+static int replay_proxy(struct proxy *p, const char *method, const char *path, const char *token, char *res,
+                        size_t len)
+{
+  char req[MAXBUF * 2];
+  int n = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: localhost\r\n", method, path);
+  if (token != NULL) {
+    n += snprintf(req + n, sizeof(req) - n, "Authorization: token %s\r\n", token);
+  }
+  snprintf(req + n, sizeof(req) - n, "\r\n");
+
+  int fds[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  cr_assert_eq(write(fds[0], req, strlen(req)), (ssize_t)strlen(req));
+
+  int code = octopass_proxy_receive(p, fds[1]);
+  close(fds[1]);
+  memset(res, 0, len);
+  size_t total = 0;
+  ssize_t r;
+  while (total < len - 1 && (r = read(fds[0], res + total, len - 1 - total)) > 0) {
+    total += r;
+  }
+  close(fds[0]);
+
+  return code;
+}
+
+Test(octopass, proxy_receive, .init = setup)
+{
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+  struct proxy proxy;
+  octopass_proxy_init(&proxy, &con);
+
+  char path[MAXBUF];
+  snprintf(path, sizeof(path), "/orgs/%s/teams?per_page=100", con.organization);
+  char first[MAXBUF * 8];
+  char second[MAXBUF * 8];
+  cr_assert_eq(replay_proxy(&proxy, "GET", path, con.token, first, sizeof(first)), 200);
+  cr_assert_eq(replay_proxy(&proxy, "GET", path, con.token, second, sizeof(second)), 200);
+  cr_assert_str_eq(first, second);
+  cr_assert_eq(proxy.count, 1);
+
+  // Kept per token, another token is asked to GitHub.
+  cr_assert_eq(replay_proxy(&proxy, "GET", path, "dummydummydummydummydummydummydummydumm", first, sizeof(first)), 401);
+  cr_assert_eq(proxy.count, 1);
+
+  cr_assert_eq(replay_proxy(&proxy, "GET", path, NULL, first, sizeof(first)), 401);
+  cr_assert_eq(replay_proxy(&proxy, "POST", path, con.token, first, sizeof(first)), 405);
+  cr_assert_eq(replay_proxy(&proxy, "GET", "/orgs/yourorganization/members", con.token, first, sizeof(first)), 404);
+
+  octopass_proxy_free(&proxy);
+}
+
+// Sends Varlink calls and returns the replies, separated by newlines instead of NUL.
+static int replay_userdb(struct config *con, const char *calls[], int count, char *res, size_t len)
+{
+  int fds[2];
+  cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int i;
+  for (i = 0; i < count; i++) {
+    cr_assert_eq(write(fds[0], calls[i], strlen(calls[i]) + 1), (ssize_t)strlen(calls[i]) + 1);
+  }
+  shutdown(fds[0], SHUT_WR);
+
+  int answered = octopass_userdb_receive(con, fds[1]);
+  close(fds[1]);
+  memset(res, 0, len);
+  size_t total = 0;
+  ssize_t r;
+  while (total < len - 1 && (r = read(fds[0], res + total, len - 1 - total)) > 0) {
+    total += r;
+  }
+  close(fds[0]);
+  for (i = 0; i < (int)total; i++) {
+    if (res[i] == '\0') {
+      res[i] = '\n';
+    }
+  }
+
+  return answered;
+}
+
+Test(octopass, userdb_receive)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass_teams.conf");
+
+  json_error_t error;
+  struct snapshot *snap = octopass_snapshot_new(
+      &con, json_loads("[{\"login\":\"linyows\",\"id\":1},{\"login\":\"ken\",\"id\":2}]", 0, &error));
+  octopass_snapshot_add_team(snap, "ops", 3001, json_loads("[{\"login\":\"ken\",\"id\":2}]", 0, &error));
+  octopass_generation_stat(octopass_hash(snap->key, 0), &snap->generation_ino, &snap->generation_mtime);
+  octopass_snapshot_publish(snap);
+  octopass_snapshot_unref(snap);
+
+  char res[MAXBUF * 8];
+  const char *by_name[] = {
+    "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":{\"userName\":\"ken\",\"service\":"
+    "\"io.systemd.Octopass\"}}",
+    "{\"method\":\"io.systemd.UserDatabase.GetGroupRecord\",\"parameters\":{\"gid\":3001}}",
+  };
+  cr_assert_eq(replay_userdb(&con, by_name, 2, res, sizeof(res)), 2);
+  json_t *user   = json_loads(strtok(res, "\n"), 0, &error);
+  json_t *group  = json_loads(strtok(NULL, "\n"), 0, &error);
+  json_t *record = json_object_get(json_object_get(user, "parameters"), "record");
+  cr_assert_str_eq(json_string_value(json_object_get(record, "userName")), "ken");
+  cr_assert_eq(json_integer_value(json_object_get(record, "uid")), 2002);
+  cr_assert_eq(json_integer_value(json_object_get(record, "gid")), 2000);
+  cr_assert_str_eq(json_string_value(json_object_get(record, "homeDirectory")), "/home/ken");
+  record = json_object_get(json_object_get(group, "parameters"), "record");
+  cr_assert_str_eq(json_string_value(json_object_get(record, "groupName")), "ops");
+  cr_assert_eq(json_array_size(json_object_get(record, "members")), 1);
+  json_decref(user);
+  json_decref(group);
+
+  // Enumerating streams one reply per record.
+  const char *all[] = { "{\"method\":\"io.systemd.UserDatabase.GetMemberships\",\"parameters\":{},\"more\":true}" };
+  cr_assert_eq(replay_userdb(&con, all, 1, res, sizeof(res)), 1);
+  cr_assert(strstr(res, "\"continues\":true") != NULL);
+  cr_assert(strstr(res, "{\"userName\":\"ken\",\"groupName\":\"ops\"}") != NULL);
+  cr_assert(strstr(res, "{\"userName\":\"linyows\",\"groupName\":\"yourteam\"}") != NULL);
+
+  // Both filters have to match the same member or team.
+  const char *filtered[] = {
+    "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":{\"uid\":2001,\"userName\":\"ken\"}}",
+    "{\"method\":\"io.systemd.UserDatabase.GetMemberships\",\"parameters\":{\"userName\":\"ken\",\"groupName\":"
+    "\"ops\"}}",
+    "{\"method\":\"io.systemd.UserDatabase.GetMemberships\",\"parameters\":{\"userName\":\"linyows\",\"groupName\":"
+    "\"ops\"}}",
+  };
+  cr_assert_eq(replay_userdb(&con, filtered, 3, res, sizeof(res)), 3);
+  cr_assert_str_eq(res, "{\"error\":\"io.systemd.UserDatabase.NoRecordFound\",\"parameters\":{}}\n"
+                        "{\"parameters\":{\"userName\":\"ken\",\"groupName\":\"ops\"}}\n"
+                        "{\"error\":\"io.systemd.UserDatabase.NoRecordFound\",\"parameters\":{}}\n");
+
+  const char *errors[] = {
+    "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":{}}",
+    "{\"method\":\"io.systemd.UserDatabase.GetUserRecord\",\"parameters\":{\"uid\":0}}",
+    "{\"method\":\"io.systemd.UserDatabase.GetGroupRecord\",\"parameters\":{\"service\":\"io.systemd.Other\"}}",
+    "{\"method\":\"org.varlink.service.GetInfo\",\"parameters\":{}}",
+  };
+  cr_assert_eq(replay_userdb(&con, errors, 4, res, sizeof(res)), 4);
+  cr_assert_str_eq(res, "{\"error\":\"org.varlink.service.ExpectedMore\",\"parameters\":{}}\n"
+                        "{\"error\":\"io.systemd.UserDatabase.NoRecordFound\",\"parameters\":{}}\n"
+                        "{\"error\":\"io.systemd.UserDatabase.BadService\",\"parameters\":{}}\n"
+                        "{\"error\":\"org.varlink.service.MethodNotFound\",\"parameters\":{}}\n");
+}
+
+Test(octopass, refresh_jitter)
+{
+  clearenv();
+
+  struct config con;
+  octopass_config_loading(&con, "test/octopass.conf");
+
+  long jitter = octopass_refresh_jitter(&con);
+  cr_assert_geq(jitter, 0);
+  cr_assert_leq(jitter, con.cache / 4);
+  cr_assert_eq(octopass_refresh_jitter(&con), jitter);
+}
+
+Test(octopass, refresh, .init = setup)
+{
+  struct config con;
+  char *f = "test/octopass.conf";
+  octopass_config_loading(&con, f);
+
+  char file[MAXBUF * 4];
+  octopass_keys_file(&con, "ken", file, sizeof(file));
+  unlink(file);
+
+  cr_assert_eq(octopass_refresh(&con), 0);
+  cr_assert(con.refresh == false);
+  cr_assert_eq(octopass_file_is_fresh(&con, file), 1);
+  cr_assert_eq(octopass_presence_lookup(&con, "ken"), 1);
+}
+
 Test(octopass, github_user_keys, .init = setup)
 {
   struct config con;
@@ -483,7 +1791,7 @@ Test(octopass, github_team_members_keys, .init = setup)
   struct config con;
   char *f = "test/octopass.conf";
   octopass_config_loading(&con, f);
-  const char *keys = octopass_github_team_members_keys(&con);
+  const char *keys = octopass_github_team_members_keys(&con, NULL);
   cr_assert_str_eq(keys,
                    "ssh-rsa "
                    "AAAAB3NzaC1yc2EAAAABIwAAAQEAqUJvs1vKgHRMH1dpxYcBBV687njS2YrJ+"
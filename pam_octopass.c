@@ -0,0 +1,72 @@
+/* Management linux user and authentication with the organization/team on Github.
+   Copyright (C) 2017 Tomohisa Oda
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "octopass.h"
+
+#define PAM_SM_AUTH
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+// Authenticates the user with a github personal access token as the password.
+// Arguments:
+//   config=PATH  use another config file than OCTOPASS_CONFIG_FILE
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+  char config_file[MAXBUF] = OCTOPASS_CONFIG_FILE;
+
+  int i;
+  for (i = 0; i < argc; i++) {
+    if (strncmp(argv[i], "config=", strlen("config=")) == 0) {
+      snprintf(config_file, sizeof(config_file), "%s", argv[i] + strlen("config="));
+    }
+  }
+
+  const char *user;
+  if (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || user == NULL || strlen(user) == 0) {
+    return PAM_USER_UNKNOWN;
+  }
+
+  const char *token;
+  if (pam_get_authtok(pamh, PAM_AUTHTOK, &token, NULL) != PAM_SUCCESS || token == NULL) {
+    return PAM_AUTH_ERR;
+  }
+
+  // Never octopass_config_loading here, it exits when the file cannot be read.
+  struct config con;
+  if (octopass_config_load(&con, config_file) != 0) {
+    return PAM_AUTHINFO_UNAVAIL;
+  }
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- user: %s", __func__, __LINE__, user);
+  }
+
+  if (octopass_autentication_with_token(&con, (char *)user, (char *)token) != 0) {
+    if (con.syslog) {
+      syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "AUTH_ERR");
+    }
+    return PAM_AUTH_ERR;
+  }
+
+  if (con.syslog) {
+    syslog(LOG_INFO, "%s[L%d] -- status: %s", __func__, __LINE__, "SUCCESS");
+  }
+  return PAM_SUCCESS;
+}
+
+PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+  return PAM_SUCCESS;
+}
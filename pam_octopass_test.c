@@ -0,0 +1,72 @@
+/* Management linux user and authentication with the organization/team on Github.
+   Copyright (C) 2017 Tomohisa Oda
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <criterion/criterion.h>
+#include "pam_octopass.c"
+
+// The handle is opaque to modules, so the test gives its own in place of libpam.
+struct pam_handle {
+  const char *user;
+  const char *token;
+};
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
+{
+  *user = pamh->user;
+  return PAM_SUCCESS;
+}
+
+int pam_get_authtok(pam_handle_t *pamh, int item, const char **authtok, const char *prompt)
+{
+  *authtok = pamh->token;
+  return PAM_SUCCESS;
+}
+
+Test(pam_octopass, authenticate__when_config_is_missing)
+{
+  clearenv();
+
+  struct pam_handle pamh = { "linyows", "secrettoken" };
+  const char *argv[]     = { "config=test/octopass-not-exist.conf" };
+  cr_assert_eq(pam_sm_authenticate(&pamh, 0, 1, argv), PAM_AUTHINFO_UNAVAIL);
+
+  struct pam_handle nobody = { "", "secrettoken" };
+  cr_assert_eq(pam_sm_authenticate(&nobody, 0, 1, argv), PAM_USER_UNKNOWN);
+}
+
+Test(pam_octopass, authenticate__when_config_is_malformed)
+{
+  clearenv();
+
+  // Lines without a key or a value, and a last line without a newline.
+  char *f    = "/tmp/octopass-test-malformed.conf";
+  FILE *file = fopen(f, "w");
+  cr_assert_not_null(file);
+  fputs("=\nToken\n  = orphan\nCache =\nEndpoint = \"http://127.0.0.1:1/\"\n\"\"\nSyslog = false", file);
+  fclose(file);
+
+  struct config con;
+  cr_assert_eq(octopass_config_load(&con, f), 0);
+  cr_assert_str_eq(con.endpoint, "http://127.0.0.1:1/");
+  cr_assert_eq(con.cache, 500);
+  cr_assert(con.syslog == false);
+
+  // GitHub is unreachable, the user is refused and the caller goes on.
+  struct pam_handle pamh = { "octopass-test-pam", "unverifiedtoken" };
+  const char *argv[]     = { "config=/tmp/octopass-test-malformed.conf" };
+  cr_assert_eq(pam_sm_authenticate(&pamh, 0, 1, argv), PAM_AUTH_ERR);
+  unlink(f);
+}
@@ -8,11 +8,11 @@ Source:           %{name}-%{version}.tar.gz
 Group:            System Environment/Base
 Packager:         linyows <linyows@gmail.com>
 %if 0%{?rhel} < 6
-Requires:         glibc curl-devel jansson-devel
+Requires:         glibc curl-devel jansson-devel zlib-devel openssl-devel
 %else
-Requires:         glibc libcurl-devel jansson-devel
+Requires:         glibc libcurl-devel jansson-devel zlib-devel openssl-devel
 %endif
-BuildRequires:    gcc make
+BuildRequires:    gcc make pam-devel zlib-devel openssl-devel
 BuildRoot:        %{_tmppath}/%{name}-%{version}-%{release}-root-%(%{__id_u} -n)
 BuildArch:        i386, x86_64
 
@@ -51,6 +51,7 @@ install -m 644 octopass.conf.example %{buildroot}%{_sysconfdir}/octopass.conf.ex
 /usr/lib64/libnss_octopass.so
 /usr/lib64/libnss_octopass.so.2
 /usr/lib64/libnss_octopass.so.2.0
+/usr/lib64/security/pam_octopass.so
 /usr/bin/octopass
 /var/cache/octopass
 /etc/octopass.conf.example